@@ -17,35 +17,116 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 
 // RFC 7519 compliant library
 #include <jwt.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
 
 #include "apr_strings.h"
 #include "apr_lib.h"                /* for apr_isspace */
+#include "apr_base64.h"
+#include "apr_sha1.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_rwlock.h"
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_pool.h"
+#include "apr_hash.h"
 
 #include "ap_config.h"
 #include "httpd.h"
 #include "http_config.h"
+#include "http_connection.h"
 #include "http_core.h"
 #include "http_log.h"
 #include "http_protocol.h"
 #include "http_request.h"
 #include "ap_provider.h"
+#include "ap_socache.h"
+#include "util_mutex.h"
+#include "ap_mpm.h"
 
 #include "mod_auth.h"
 
 #define JWT_LOGIN_HANDLER "jwt-login-handler"
-#define JWT_LOGOUT_HANDLER "jwt-login-handler"
+#define JWT_LOGOUT_HANDLER "jwt-logout-handler"
+#define JWT_INVALIDATE_HANDLER "jwt-invalidate-handler"
+#define JWT_MINT_HANDLER "jwt-mint-handler"
+#define JWT_REFRESH_HANDLER "jwt-refresh-handler"
 #define USER_INDEX 0
 #define PASSWORD_INDEX 1
 #define FORM_SIZE 512
+#define LOGIN_KEY_SIZE 16
+#define TOKEN_DIGEST_SIZE APR_SHA1_DIGESTSIZE
+#define CACHED_USER_SIZE 256
+#define DEFAULT_CACHE_SIZE 1024
+#define DEFAULT_CACHE_FILE_ENTRIES 16384
+#define CACHE_FILE_MAGIC "JWTCACHE"
+#define CACHE_FILE_VERSION 3
+#define SOCACHE_MUTEX_TYPE "authnz-jwt-socache"
+#define SOCACHE_QUEUE_SIZE 256
+#define SOCACHE_MAC_SIZE 32
+#define SOCACHE_VALUE_SIZE (CACHED_USER_SIZE + 96 + 2 * SOCACHE_MAC_SIZE + 1)
+#define REVOCATION_MUTEX_TYPE "authnz-jwt-revocation"
+#define REVOCATION_SHM_KEY "auth_jwt_revocation_shm"
+#define REVOCATION_BUCKET_SIZE 8
+#define DEFAULT_REVOCATION_TABLE_SIZE 65536
+#define JTI_SIZE 16
+#define REVOCATION_LIST_MUTEX_TYPE "authnz-jwt-revocation-list"
+#define DEFAULT_REVOCATION_LIST_SIZE 524288
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_HASHES 8
+#define USER_INVALIDATION_MUTEX_TYPE "authnz-jwt-user-invalidation"
+#define USER_INVALIDATION_SHM_KEY "auth_jwt_user_invalidation_shm"
+#define DEFAULT_USER_INVALIDATION_TABLE_SIZE 16384
+#define DEFAULT_USER_INVALIDATION_LIFETIME 86400
+#define DEFAULT_LOGIN_CACHE_SIZE 4096
+#define LOGIN_CACHE_SALT_SIZE 16
+#define DEFAULT_LOGIN_WAIT 1000
+#define LOGIN_RETRY_AFTER "1"
+#define DEFAULT_THROTTLE_TABLE_SIZE 16384
+#define THROTTLE_BUCKET_SIZE 4
+#define THROTTLE_STRIPES 64
+#define THROTTLE_SPINS 64
+#define DEFAULT_PROVIDER_THREADS 16
+#define LOGIN_TASK_KEY "auth_jwt_login_task"
+#define MINT_BODY_SIZE (1024 * 1024)
+#define MINT_CHUNK_SIZE 256
+#define MINT_CHUNKS_PER_THREAD 2
+#define RENEW_HEADER "X-Renewed-Token"
+#define RENEW_CACHE_SIZE 256
+#define RENEWED_TOKEN_SIZE 1024
+#define REFRESH_MUTEX_TYPE "authnz-jwt-refresh"
+#define REFRESH_SHM_KEY "auth_jwt_refresh_table"
+#define REFRESH_BUCKET_SIZE 4
+#define REFRESH_TOKEN_SIZE 32
+#define DEFAULT_REFRESH_LIFETIME 2592000
+#define ALLOWLIST_MUTEX_TYPE "authnz-jwt-allowlist"
+#define ALLOWLIST_MAGIC "JWTALLOW"
+#define ALLOWLIST_VERSION 2
+#define ALLOWLIST_MAX_DISPLACEMENT (1 << 24)
+#define REGEX_JIT_STACK_START (32 * 1024)
+#define REGEX_JIT_STACK_MAX (512 * 1024)
+#define RANDOM_KEY_SIZE 32
+#define RANDOM_BUFFER_SIZE 1024
 
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  CONFIGURATION STRUCTURE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
 
 typedef struct {
     authn_provider_list *providers;
+    int providers_parallel;
 
     const char* signature_algorithm;
     int signature_algorithm_set;
@@ -62,6 +143,15 @@ typedef struct {
     int leeway;
     int leeway_set;
 
+    int renew_window;
+    int renew_window_set;
+
+    int max_session_age;
+    int max_session_age_set;
+
+    int refresh_table_size;
+    int refresh_lifetime;
+
     const char* iss;
     int iss_set;
 
@@ -71,11 +161,706 @@ typedef struct {
     const char* aud;
     int aud_set;
 
+    int cache_size;
+    int cache_size_set;
+
+    const char* cache_file;
+    int cache_file_entries;
+
+    const ap_socache_provider_t *socache_provider;
+    const char* socache_args;
+
+    int revocation_table_size;
+    int revocation_table_size_set;
+
+    const char* revocation_file;
+    int revocation_file_entries;
+
+    int user_invalidation_table_size;
+    int user_invalidation_lifetime;
+    const char* user_invalidation_file;
+
+    int login_cache_ttl;
+    int login_cache_size;
+
+    int login_concurrency;
+    int login_queue;
+    int login_wait;
+
+    int throttle_ip_rate;
+    int throttle_ip_burst;
+    int throttle_user_rate;
+    int throttle_user_burst;
+    int throttle_table_size;
+
+    int provider_threads;
+    int login_threads;
+    int mint_threads;
+    apr_array_header_t *mint_users;
+    apr_array_header_t *invalidate_users;
+
     char *dir;
 
 } auth_jwt_config_rec;
 
-typedef enum { dir_signature_algorithm, dir_signature_secret, dir_exp_delay, dir_nbf_delay, dir_iss, dir_sub, dir_aud, dir_leeway} jwt_directive;
+typedef enum { dir_signature_algorithm, dir_signature_secret, dir_exp_delay, dir_nbf_delay, dir_iss, dir_sub, dir_aud, dir_leeway, dir_cache_size, dir_revocation_table_size, dir_throttle_table_size, dir_provider_threads, dir_login_threads, dir_mint_threads, dir_renew_window, dir_max_session_age} jwt_directive;
+
+/*
+Outcome of a successful token verification, stored in r->request_config so that
+subrequests and internal redirects carrying the same Authorization header can
+reuse it instead of verifying the token again.
+*/
+typedef struct {
+    const char *authorization;
+    const char *signature_secret;
+    const char *iss;
+    const char *aud;
+    const char *sub;
+    const char *user;
+    jwt_t *token;
+    int masks_set;
+    apr_uint64_t scope_mask;
+    apr_uint64_t role_mask;
+    const request_rec *claims_owner;
+    apr_hash_t *claims;
+} auth_jwt_request_rec;
+
+/*
+What the caches remember about a verified token: enough to authenticate the
+request and to check its expiration and revocation again on every hit, and the
+time of the login the token descends from, which renewals carry over.
+*/
+typedef struct {
+    apr_time_t exp;
+    apr_time_t iat;
+    apr_time_t auth_time;
+    apr_uint64_t jti;
+    char user[CACHED_USER_SIZE];
+} verified_token;
+
+/*
+Last token verified on a connection. Keep-alive and HTTP/2 clients send the
+same token on every request, so later requests only need a digest comparison
+and an exp check. HTTP/2 streams share the record of their master connection.
+*/
+typedef struct {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    int valid;
+    unsigned char digest[TOKEN_DIGEST_SIZE];
+    verified_token token;
+} auth_jwt_conn_rec;
+
+/*
+Per child cache of verified tokens. Concurrent misses on the same token are
+coalesced: the first thread verifies it while the others wait on its flight.
+*/
+typedef struct {
+    int valid;
+    unsigned char digest[TOKEN_DIGEST_SIZE];
+    verified_token token;
+} token_cache_entry;
+
+typedef struct token_flight {
+    unsigned char digest[TOKEN_DIGEST_SIZE];
+#if APR_HAS_THREADS
+    apr_thread_cond_t *cond;
+#endif
+    int done;
+    int waiters;
+    int verified;
+    verified_token token;
+    struct token_flight *next;
+} token_flight;
+
+typedef struct {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    token_cache_entry *entries;
+    int size;
+    token_flight *flights;
+    token_flight *free_flights;
+} token_cache_t;
+
+static token_cache_t token_cache;
+
+/*
+Verified tokens shared by all children through a memory-mapped file. The file
+outlives graceful restarts, and its entries are tagged with the generation of
+the configured key set, so that tokens verified under unchanged keys stay warm.
+Readers are lock-free: every entry is guarded by a sequence number which is odd
+while a writer updates it.
+*/
+typedef struct {
+    char magic[8];
+    apr_uint32_t version;
+    apr_uint32_t entries;
+    apr_uint32_t entry_size;
+    apr_uint32_t generation;
+} shared_cache_header;
+
+typedef struct {
+    volatile apr_uint32_t seq;
+    apr_uint32_t generation;
+    unsigned char digest[TOKEN_DIGEST_SIZE];
+    verified_token token;
+} shared_cache_entry;
+
+typedef struct {
+    shared_cache_header *header;
+    shared_cache_entry *entries;
+    apr_uint32_t size;
+    apr_uint32_t generation;
+} shared_cache_t;
+
+static shared_cache_t shared_cache;
+static apr_sha1_ctx_t key_set_context;
+
+/*
+Second tier cache backed by a mod_socache provider (memcache, redis, ...) so
+that a token verified on one node of a farm is known by the others. Lookups
+happen once the local caches missed, stores are queued and written in batches
+by a dedicated thread in each child so that they never delay a response.
+Values carry an HMAC keyed with the signature secret, so that whoever can write
+to the cache cannot forge or alter entries.
+*/
+typedef struct {
+    unsigned char digest[TOKEN_DIGEST_SIZE];
+    verified_token token;
+    const char *secret;
+} remote_cache_write;
+
+typedef struct {
+    const ap_socache_provider_t *provider;
+    ap_socache_instance_t *instance;
+    apr_global_mutex_t *mutex;
+    server_rec *server;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *queue_mutex;
+    apr_thread_cond_t *queue_cond;
+    apr_thread_t *writer;
+    remote_cache_write queue[SOCACHE_QUEUE_SIZE];
+    int queued;
+    int stopping;
+#endif
+} remote_cache_t;
+
+static remote_cache_t remote_cache;
+
+/*
+Revoked token identifiers (jti), in shared memory so that a logout seen by one
+child applies to all of them. The table has a fixed size: a jti hashes to a
+bucket of a few slots, and a slot is reused as soon as the token it revokes
+has expired, so there is nothing to sweep. Lookups are lock-free, writers are
+serialized by a global mutex. The segment is kept across graceful restarts.
+*/
+typedef struct {
+    volatile apr_uint64_t jti;
+    volatile apr_uint64_t exp;
+} revocation_entry;
+
+typedef struct {
+    apr_shm_t *shm;
+    apr_global_mutex_t *mutex;
+    revocation_entry *entries;
+    apr_uint32_t buckets;
+} revocation_table_t;
+
+static revocation_table_t revocation_table;
+
+/*
+Revocation list published as a file of jti, one per line. It is compiled into
+shared memory as a blocked Bloom filter, where all the bits of a jti live in a
+single cache line, followed by the sorted jti hashes which confirm the rare
+positive answers of the filter. There are two slots: a reload fills the
+inactive one and then switches, while readers detect with a sequence number
+that the slot they read has been rewritten under their feet. Children look at
+the file mtime at most once per second, the first one to see a change compiles
+it for everybody. A file which fails to compile is remembered by its mtime and
+not retried until it changes again.
+*/
+typedef struct {
+    volatile apr_uint32_t seq;
+    apr_uint32_t count;
+    apr_time_t mtime;
+} revocation_list_slot;
+
+typedef struct {
+    volatile apr_uint32_t active;
+    apr_uint32_t capacity;
+    apr_uint32_t blocks;
+    apr_time_t failed_mtime;
+} revocation_list_header;
+
+typedef struct {
+    const char *path;
+    apr_shm_t *shm;
+    apr_global_mutex_t *mutex;
+    revocation_list_header *header;
+    apr_size_t slot_size;
+    volatile apr_uint32_t last_check;
+} revocation_list_t;
+
+static revocation_list_t revocation_list;
+
+/*
+Per user "not before" timestamps: tokens of a user issued before it are no
+longer accepted, so invalidating every token of a user, e.g. on a password
+change, is a single write. The table works like the revocation table, a slot
+being reusable once every token it could reject has expired. It is fed by the
+jwt-invalidate-handler and by an optional file of "user timestamp" lines.
+*/
+typedef struct {
+    volatile apr_uint64_t user;
+    volatile apr_uint64_t not_before;
+    volatile apr_uint64_t until;
+} user_invalidation_entry;
+
+typedef struct {
+    apr_time_t file_mtime;
+} user_invalidation_header;
+
+typedef struct {
+    apr_shm_t *shm;
+    apr_global_mutex_t *mutex;
+    user_invalidation_header *header;
+    user_invalidation_entry *entries;
+    apr_uint32_t buckets;
+    apr_time_t lifetime;
+    const char *path;
+    volatile apr_uint32_t last_check;
+} user_invalidation_t;
+
+static user_invalidation_t user_invalidation;
+
+/*
+Successful logins, shared by all children for a few seconds so that scripted
+clients logging in again do not pay for an expensive provider check (bcrypt...)
+each time. Entries are keyed by a salted digest of the provider list, the user
+and the password; the salt is drawn at each startup, so a configuration change
+of the providers drops everything. An entry is also ignored once the tokens of
+its user have been invalidated after it was created.
+*/
+typedef struct {
+    volatile apr_uint32_t seq;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    apr_uint64_t user;
+    apr_time_t created;
+    apr_time_t until;
+} login_cache_entry;
+
+typedef struct {
+    apr_shm_t *shm;
+    login_cache_entry *entries;
+    apr_uint32_t size;
+    apr_time_t ttl;
+    unsigned char salt[LOGIN_CACHE_SALT_SIZE];
+} login_cache_t;
+
+static login_cache_t login_cache;
+
+/*
+Cross-child semaphore bounding the number of provider checks running at once,
+so that a login storm cannot take every worker away from Bearer traffic. A
+bounded number of logins may wait for a slot, the others get a 503 at once.
+Each child also counts what it holds in its own holder record, so that a new
+child can give back the slots of a child which died in a provider check.
+*/
+typedef struct {
+    volatile apr_uint32_t active;
+    volatile apr_uint32_t waiting;
+} login_limiter_counters;
+
+typedef struct {
+    volatile apr_uint32_t pid;
+    volatile apr_uint32_t active;
+    volatile apr_uint32_t waiting;
+} login_limiter_holder;
+
+#define LOGIN_LIMITER_RECLAIMING ((apr_uint32_t)-1)
+
+typedef struct {
+    apr_shm_t *shm;
+    login_limiter_counters *counters;
+    login_limiter_holder *holders;
+    login_limiter_holder *self;
+    apr_uint32_t holders_count;
+    apr_uint32_t max;
+    apr_uint32_t queue;
+    apr_interval_time_t wait;
+} login_limiter_t;
+
+static login_limiter_t login_limiter;
+
+/*
+Token buckets throttling logins per client IP and per submitted username, in
+a fixed-size shared table. A key hashes to a set of a few entries, the least
+recently used one being recycled for a new key. Each set is protected by one of
+a few spinlocks (lock striping), critical sections being a handful of
+arithmetic operations; a waiter yields the CPU after a few attempts. Tokens are
+counted in thousandths, the time not yet converted into a whole thousandth is
+kept for the next request.
+*/
+typedef struct {
+    apr_uint64_t key;
+    apr_time_t last;
+    apr_uint32_t tokens;
+    apr_uint32_t pad;
+} throttle_entry;
+
+typedef struct {
+    volatile apr_uint32_t lock;
+    char pad[60];
+} throttle_stripe;
+
+typedef struct {
+    apr_shm_t *shm;
+    throttle_stripe *stripes;
+    throttle_entry *entries;
+    apr_uint32_t buckets;
+} throttle_table_t;
+
+static throttle_table_t throttle_table;
+
+#if APR_HAS_THREADS
+/*
+Providers queried concurrently by a login. The login returns as soon as the
+outcome no longer depends on pending providers, so a slow provider may still
+run while the request goes on: each query therefore works on its own copy of
+the request in its own pool, and the fan-out state lives in a pool of its own,
+released by whoever holds it last, who also gives the login slot back. The
+request pool, which holds the configuration merged for the request, is kept
+until the last query is over.
+*/
+typedef struct {
+    apr_pool_t *pool;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int refs;
+    int count;
+    int *done;
+    authn_status *results;
+} provider_fanout;
+
+typedef struct {
+    provider_fanout *fanout;
+    int index;
+    const authn_provider *provider;
+    request_rec *r;
+    const char *username;
+    const char *password;
+} provider_query;
+
+/* set at configuration time when a location enables AuthJWTProviderParallel */
+static int providers_parallel_used;
+static apr_thread_pool_t *provider_pool;
+#endif
+
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+/*
+A login whose provider checks run on a thread of login_pool while the request
+is suspended, so that the MPM worker is free to serve other requests. The task
+is only started once the MPM has actually suspended the connection.
+*/
+typedef struct {
+    request_rec *r;
+    const char *username;
+    const char *password;
+} login_task;
+
+static apr_thread_pool_t *login_pool;
+#endif
+
+/*
+Streaming parser of the fields sent to the login and refresh handlers, fed
+with the request body as it is read. Only the values of the requested fields
+(two at most) are kept, anything else is skipped.
+*/
+typedef enum { login_form, login_json } login_format;
+
+typedef enum {
+    login_form_key, login_form_value,
+    login_json_start, login_json_key_or_end, login_json_key, login_json_colon, login_json_value,
+    login_json_string, login_json_escape, login_json_unicode, login_json_scalar, login_json_nested,
+    login_json_after_value, login_json_end
+} login_state;
+
+typedef struct {
+    login_format format;
+    login_state state;
+    const char **fields;
+    int count;
+    int field;                      /* index of the field being read, -1 if skipped */
+    int found[2];
+    char key[LOGIN_KEY_SIZE];
+    apr_size_t key_len;
+    char values[2][FORM_SIZE + 1];
+    apr_size_t lens[2];
+    int depth;                      /* of nested JSON values being skipped */
+    int in_string;
+    int escape;
+    int unicode_digits;
+    apr_uint32_t unicode;
+    apr_uint32_t surrogate;
+} login_parser;
+
+/*
+What does not change between the tokens delivered at a location: the signature
+key, the encoded header, and the static claims already serialized. Templates
+are built on the first login at each location in each child.
+*/
+typedef struct {
+    const EVP_MD *md;
+    const unsigned char *key;
+    int key_len;
+    const char *header;             /* base64url encoded header, followed by '.' */
+    apr_size_t header_len;
+    const char *claims;             /* JSON members, each followed by ',' */
+    int exp_delay;                  /* -1 when tokens do not expire */
+    int nbf_delay;                  /* -1 when tokens have no nbf */
+} token_template;
+
+typedef struct {
+    const void *dconf;
+    const void *sconf;
+} token_template_key;
+
+static struct {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    apr_hash_t *templates;
+} token_templates;
+
+/*
+A chunk of the subjects of a bulk issuance, signed on a thread of mint_pool.
+Lines are allocated from the chunk's own pool, and the handler waits for every
+chunk before returning. Only a window of chunks is in flight, the next one
+being queued when one is sent, so a large body does not hold every token in
+memory at once.
+*/
+typedef struct mint_batch mint_batch;
+
+typedef struct {
+    mint_batch *batch;
+    const token_template *tpl;
+    char **subjects;
+    int count;
+    apr_pool_t *pool;
+    char **lines;
+    apr_size_t *lens;
+    apr_status_t status;
+    int queued;
+    int done;
+} mint_chunk;
+
+struct mint_batch {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+    mint_chunk *chunks;
+    int count;
+    int window;
+};
+
+#if APR_HAS_THREADS
+static apr_thread_pool_t *mint_pool;
+#endif
+
+/*
+Tokens renewed in each child, by digest of the token they renew, so that the
+requests made with a token about to expire all get the same new one. An entry
+is valid until the original token expires.
+*/
+typedef struct {
+    unsigned char digest[TOKEN_DIGEST_SIZE];
+    apr_time_t exp;
+    char token[RENEWED_TOKEN_SIZE];
+} renew_cache_entry;
+
+static struct {
+    renew_cache_entry *entries;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} renew_cache;
+
+/*
+Refresh tokens, in shared memory kept across graceful restarts. Only a digest
+of a refresh token is stored, with the user it was delivered to and a digest
+of the configuration tokens were delivered with (secret, algorithm, iss, aud
+and sub), which the refresh location must share. A slot is reused once its
+refresh token has expired. Refreshes being rare, lookups take the global mutex
+like writers do.
+*/
+typedef struct {
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    unsigned char issuer[APR_SHA1_DIGESTSIZE];
+    apr_time_t iat;
+    apr_time_t exp;
+    char user[CACHED_USER_SIZE];
+} refresh_entry;
+
+typedef struct {
+    apr_shm_t *shm;
+    apr_global_mutex_t *mutex;
+    refresh_entry *entries;
+    apr_uint32_t buckets;
+    apr_time_t lifetime;
+} refresh_table_t;
+
+static refresh_table_t refresh_table;
+
+/*
+Random bytes of jti and refresh tokens come from a buffer of each thread, filled
+by HMAC-SHA256 in counter mode. Each thread gets its own key, derived from a
+seed drawn once per child, and replaces it with the first block of each refill
+so that bytes already delivered cannot be recovered from the state.
+*/
+typedef struct {
+    unsigned char key[RANDOM_KEY_SIZE];
+    unsigned char buffer[RANDOM_BUFFER_SIZE];
+    apr_size_t pos;
+} random_state;
+
+static unsigned char random_seed[RANDOM_KEY_SIZE];
+static volatile apr_uint32_t random_threads;
+static int random_seeded = 0;
+#if APR_HAS_THREADS
+static apr_threadkey_t *random_key = NULL;
+#else
+static random_state random_single;
+static int random_single_ready = 0;
+#endif
+
+/*
+Require jwt-claim <claim> <value>..., compiled when the configuration is read:
+the values are hashed once, and looked up in the view of the claim.
+*/
+typedef struct {
+    unsigned int hash;
+    const char *value;
+} claim_match_value;
+
+typedef struct {
+    const char *claim;
+    int count;
+    claim_match_value *values;
+} claim_matcher;
+
+/*
+Scope and role names referenced by Require jwt-scope and jwt-role are interned
+into bit positions while the configuration is read. The names of a token are
+turned into a mask once per request, then each requirement is a single AND.
+*/
+#define CLAIM_BITS_MAX 64
+
+typedef struct {
+    const char *claim;
+    apr_hash_t *names;
+    int count;
+} claim_bits;
+
+typedef struct {
+    const claim_bits *bits;
+    apr_uint64_t mask;
+    int all;
+} mask_matcher;
+
+/*
+View of a claim of the request token, built once per request when a requirement
+first needs it: its values, indexed by an open addressing table of their hashes,
+so that tokens with thousands of groups are checked in constant time per value
+required.
+*/
+typedef struct {
+    int count;
+    const char **values;
+    unsigned int *hashes;
+    apr_uint32_t *table;
+    apr_uint32_t mask;
+} claim_view;
+
+static claim_bits scope_bits = { "scope", NULL, 0 };
+static claim_bits role_bits = { "roles", NULL, 0 };
+
+/*
+Require jwt-claim-in <claim> file:<path> allowlists, of one value per line. A
+list is compiled into a minimal perfect hash written to a file of the runtime
+directory, which every child maps: the displacement of the bucket of a value
+gives its slot, where the 64-bit hash of the only value it may hold rules out
+most values, and the value itself, stored after the hashes, confirms
+membership. Children look at the list mtime at most once per second, the first
+one to see a change compiles it again, then each child maps the new file.
+*/
+typedef struct {
+    char magic[8];
+    apr_uint32_t version;
+    apr_uint32_t count;
+    apr_time_t mtime;
+} allowlist_header;
+
+typedef struct {
+    const char *path;
+    const char *compiled;
+    apr_pool_t *pool;
+    const allowlist_header *header;
+    const apr_int32_t *displacements;
+    const apr_uint64_t *fingerprints;
+    const apr_uint32_t *offsets;
+    const char *values;
+    apr_size_t values_size;
+#if APR_HAS_THREADS
+    apr_thread_rwlock_t *lock;
+#endif
+    volatile apr_uint32_t last_check;
+} claim_allowlist;
+
+typedef struct {
+    apr_uint64_t hash;
+    const char *value;
+} allowlist_value;
+
+typedef struct {
+    const char *claim;
+    claim_allowlist *list;
+} allowlist_matcher;
+
+static apr_hash_t *allowlists = NULL;
+static apr_global_mutex_t *allowlist_mutex = NULL;
+static apr_pool_t *allowlist_pool = NULL;
+
+/*
+Require jwt-claim-regex <claim> <pattern>: the pattern is compiled, and JIT
+compiled when PCRE2 supports it, while the configuration is read or, for
+.htaccess files, per request. Matching needs match data, and a JIT stack when
+PCRE2 has JIT support, which each thread creates on its first match and keeps
+until it exits.
+*/
+typedef struct {
+    const char *claim;
+    const char *pattern;
+    pcre2_code *code;
+    int jit;
+} regex_matcher;
+
+typedef struct {
+    pcre2_match_data *data;
+    pcre2_match_context *context;
+    pcre2_jit_stack *stack;
+} regex_state;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *regex_key = NULL;
+#else
+static regex_state *regex_single = NULL;
+#endif
+
 //typedef struct jwt_t token_t;
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  FUNCTIONS HEADERS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
@@ -88,22 +873,201 @@ static void register_hooks(apr_pool_t * p);
 static const char *add_authn_provider(cmd_parms * cmd, void *config, const char *arg);
 static const char *set_jwt_param(cmd_parms * cmd, void* config, const char* value);
 static const char *set_jwt_int_param(cmd_parms * cmd, void* config, const char* value);
+static const char *set_cache_file(cmd_parms * cmd, void* config, const char* path, const char* entries);
+static const char *set_socache(cmd_parms * cmd, void* config, const char* arg);
+static const char *set_revocation_file(cmd_parms * cmd, void* config, const char* path, const char* entries);
+static const char *set_user_invalidation_table(cmd_parms * cmd, void* config, const char* entries, const char* lifetime);
+static const char *set_user_invalidation_file(cmd_parms * cmd, void* config, const char* path);
+static const char *set_login_cache(cmd_parms * cmd, void* config, const char* ttl, const char* entries);
+static const char *set_login_concurrency(cmd_parms * cmd, void* config, const char* max, const char* queue, const char* wait);
+static const char *set_login_throttle(cmd_parms * cmd, void* config, const char* key, const char* rate, const char* burst);
+static const char *set_providers_parallel(cmd_parms * cmd, void* config, int flag);
+static const char *set_refresh_table(cmd_parms * cmd, void* config, const char* entries, const char* lifetime);
+static const char *add_mint_user(cmd_parms * cmd, void* config, const char* user);
+static const char *add_invalidate_user(cmd_parms * cmd, void* config, const char* user);
+static int user_listed(const apr_array_header_t *users, const char *user);
 static void* get_config_value(request_rec *r, jwt_directive directive);
 
 static int check_key_length(request_rec *r, const char* key, const char* algorithm);
 static int auth_jwt_login_handler(request_rec *r);
 static int check_authn(request_rec *r, const char *username, const char *password);
-static int create_token(request_rec *r, char** token_str, const char* username);
+static int login_respond(request_rec *r, int rv, const char *username);
+static int token_respond(request_rec *r, const char *username, const char *refresh_token);
+static int login_credentials(request_rec *r, const char **username, const char **password);
+static int read_fields(request_rec *r, const char **fields, int count, const char **values);
+static int login_basic_credentials(request_rec *r, const char *authorization, const char **username, const char **password);
+static int login_parse(login_parser *parser, const char *data, apr_size_t len);
+static void login_parser_end_key(login_parser *parser);
+static void login_parser_append(login_parser *parser, char c);
+static void login_parser_append_unicode(login_parser *parser, apr_uint32_t code);
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+static int login_suspend(request_rec *r, const char *username, const char *password);
+static void auth_jwt_suspend_connection(conn_rec *c, request_rec *r);
+static void *APR_THREAD_FUNC login_resume(apr_thread_t *thread, void *data);
+#endif
+static authn_status check_providers(request_rec *r, const char *username, const char *password);
+#if APR_HAS_THREADS
+static authn_status check_providers_parallel(request_rec *r, const char *username, const char *password);
+static request_rec *provider_query_request(apr_pool_t *p, request_rec *r);
+static void provider_fanout_release(provider_fanout *fanout);
+static apr_status_t provider_fanout_cleanup(void *data);
+static void *APR_THREAD_FUNC provider_query_run(apr_thread_t *thread, void *data);
+#endif
+static int create_token(request_rec *r, char** token_str, const char* username, apr_time_t auth_time);
+static int token_write(request_rec *r, const char *username, apr_time_t auth_time, const char *prefix, const char *suffix, char **out, apr_size_t *out_len);
+static apr_status_t token_sign(apr_pool_t *p, const token_template *tpl, const char *username, apr_time_t auth_time,
+                               const char *prefix, const char *suffix, char **out, apr_size_t *out_len);
+static int token_template_get(request_rec *r, const token_template **tpl);
+static int token_template_build(request_rec *r, apr_pool_t *p, token_template *tpl);
+static const char *json_escape(apr_pool_t *p, const char *str);
+static apr_size_t base64url_encode(char *dst, const unsigned char *src, apr_size_t len);
 
 static int auth_jwt_authn_with_token(request_rec *r);
+static const auth_jwt_request_rec *find_verified_request(request_rec *r, const char *authorization);
+static int same_param(const char *a, const char *b);
+static void set_verified_request(request_rec *r, const char *authorization, const char *user, jwt_t *token);
+
+static int auth_jwt_pre_connection(conn_rec *c, void *csd);
+static auth_jwt_conn_rec *get_conn_cache(request_rec *r);
+static int conn_cache_lookup(request_rec *r, const unsigned char *digest, verified_token *vt);
+static void conn_cache_store(request_rec *r, const unsigned char *digest, const verified_token *vt);
+
+static int auth_jwt_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp);
+static int auth_jwt_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+static void auth_jwt_child_init(apr_pool_t *p, server_rec *s);
+static void token_cache_lock(void);
+static void token_cache_unlock(void);
+static int token_cache_acquire(request_rec *r, const unsigned char *digest, verified_token *vt, token_flight **flight);
+static void token_cache_release(const unsigned char *digest, token_flight *flight, const verified_token *vt);
+
+static apr_status_t shared_cache_attach(apr_pool_t *p, server_rec *s, const char *path, apr_uint32_t entries);
+static int shared_cache_lookup(request_rec *r, const unsigned char *digest, verified_token *vt);
+static void shared_cache_store(const unsigned char *digest, const verified_token *vt);
+
+static apr_status_t remote_cache_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, auth_jwt_config_rec *sconf);
+static apr_status_t remote_cache_destroy(void *data);
+static void remote_cache_child_init(apr_pool_t *p, server_rec *s);
+static int remote_cache_lookup(request_rec *r, const unsigned char *digest, verified_token *vt);
+static void remote_cache_store(request_rec *r, const unsigned char *digest, const verified_token *vt);
+static void remote_cache_write_entry(apr_pool_t *p, const remote_cache_write *entry);
+static void remote_cache_mac(const char *secret, const unsigned char *digest, const char *fields, apr_size_t len, char *hex);
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC remote_cache_writer(apr_thread_t *thread, void *data);
+static apr_status_t remote_cache_stop_writer(void *data);
+#endif
+
+static int auth_jwt_logout_handler(request_rec *r);
+static apr_status_t revocation_table_init(apr_pool_t *pconf, server_rec *s, apr_uint32_t entries);
+static void revocation_table_child_init(apr_pool_t *p, server_rec *s);
+static apr_status_t revocation_table_add(apr_uint64_t jti, apr_time_t exp);
+static int revocation_table_contains(apr_uint64_t jti, apr_time_t now);
+static int token_revoked(request_rec *r, apr_uint64_t jti);
+
+static apr_status_t revocation_list_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, auth_jwt_config_rec *sconf);
+static void revocation_list_child_init(apr_pool_t *p, server_rec *s);
+static revocation_list_slot *revocation_list_slot_get(apr_uint32_t index);
+static apr_status_t revocation_list_compile(apr_pool_t *p, apr_time_t mtime);
+static void revocation_list_refresh(request_rec *r);
+static int revocation_list_contains(request_rec *r, apr_uint64_t jti);
+static void bloom_positions(apr_uint64_t jti, apr_uint32_t blocks, apr_uint32_t *block, unsigned int *positions);
+static int compare_jti(const void *a, const void *b);
+
+static apr_status_t shm_attach_persistent(server_rec *s, const char *key, apr_size_t size, apr_shm_t **shm);
+static apr_status_t user_invalidation_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, auth_jwt_config_rec *sconf);
+static void user_invalidation_child_init(apr_pool_t *p, server_rec *s);
+static apr_status_t user_invalidation_set_locked(apr_uint64_t user, apr_time_t not_before);
+static apr_status_t user_invalidation_set(const char *user, apr_time_t not_before);
+static apr_status_t user_invalidation_load(apr_pool_t *p, apr_time_t mtime);
+static void user_invalidation_refresh(request_rec *r);
+static int user_invalidated(request_rec *r, const char *user, apr_time_t iat);
+static int auth_jwt_invalidate_handler(request_rec *r);
+
+static int auth_jwt_refresh_handler(request_rec *r);
+static apr_status_t refresh_table_init(apr_pool_t *pconf, server_rec *s, auth_jwt_config_rec *sconf);
+static void refresh_table_child_init(apr_pool_t *p, server_rec *s);
+static const char *refresh_table_issue(request_rec *r, const char *user);
+static int refresh_table_lookup(request_rec *r, const char *refresh_token, const char **user);
+static void refresh_table_remove(const char *refresh_token);
+static refresh_entry *refresh_table_find(const unsigned char *digest, apr_time_t now);
+static void refresh_digest(const char *refresh_token, unsigned char *digest);
+static void refresh_issuer_digest(request_rec *r, unsigned char *digest);
+
+static int auth_jwt_mint_handler(request_rec *r);
+static int mint_read_subjects(request_rec *r, apr_array_header_t **subjects);
+static void mint_chunk_queue(mint_batch *batch, int index);
+static void mint_chunk_sign(mint_chunk *chunk);
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC mint_chunk_run(apr_thread_t *thread, void *data);
+#endif
+
+static apr_status_t login_cache_init(apr_pool_t *pconf, auth_jwt_config_rec *sconf);
+static void location_identity_update(request_rec *r, apr_sha1_ctx_t *context);
+static void login_cache_digest(request_rec *r, const char *username, const char *password, unsigned char *digest);
+static int login_cache_lookup(request_rec *r, const char *username, const unsigned char *digest);
+static void login_cache_store(request_rec *r, const char *username, const unsigned char *digest);
+
+static apr_status_t login_limiter_init(apr_pool_t *pconf, auth_jwt_config_rec *sconf);
+static void login_limiter_child_init(apr_pool_t *p, server_rec *s);
+static int login_limiter_try(void);
+static int login_limiter_acquire(request_rec *r);
+static void login_limiter_release(void);
+
+static apr_status_t throttle_init(apr_pool_t *pconf, auth_jwt_config_rec *sconf);
+static int throttle_take(const char *prefix, const char *value, int rate, int burst, apr_time_t now, apr_interval_time_t *retry);
+static int throttle_check(request_rec *r, const char *prefix, const char *value, int rate, int burst);
+
+static int verified_token_check(request_rec *r, const verified_token *vt);
+static int verified_token_from_jwt(jwt_t *token, const char *user, verified_token *vt);
 
 static int token_check(request_rec *r, jwt_t **jwt, const char *token, const unsigned char *key);
-static int token_new(jwt_t **jwt);
 static const char* token_get_claim(jwt_t *token, const char* claim);
-static int token_add_claim(jwt_t *jwt, const char *claim, const char *val);
 static void token_free(jwt_t *token);
-static int token_set_alg(jwt_t *jwt, jwt_alg_t alg, unsigned char *key, int len);
-static char *token_encode_str(jwt_t *jwt);
+static apr_status_t token_cleanup(void *data);
+static void token_digest(request_rec *r, const char *token, unsigned char *digest);
+static apr_uint32_t digest_hash(const unsigned char *digest);
+static apr_uint64_t claim_hash(const char *jti);
+static const char *generate_jti(apr_pool_t *p);
+static void random_child_init(apr_pool_t *p, server_rec *s);
+
+static const char *jwt_claim_parse(cmd_parms *cmd, const char *require_line, const void **parsed);
+static authz_status jwt_claim_check(request_rec *r, const char *require_line, const void *parsed);
+static jwt_t *request_token(request_rec *r);
+static const char *jwt_scope_parse(cmd_parms *cmd, const char *require_line, const void **parsed);
+static const char *jwt_role_parse(cmd_parms *cmd, const char *require_line, const void **parsed);
+static const char *mask_matcher_parse(cmd_parms *cmd, const char *require_line, const void **parsed, claim_bits *bits);
+static int reading_server_config(cmd_parms *cmd);
+static authz_status jwt_mask_check(request_rec *r, const char *require_line, const void *parsed);
+static const auth_jwt_request_rec *request_masks(request_rec *r);
+static apr_uint64_t claim_mask(const claim_view *view, const claim_bits *bits);
+static const claim_view *request_claim(request_rec *r, const char *claim);
+static claim_view *claim_view_make(apr_pool_t *p, apr_array_header_t *values);
+static int claim_view_contains(const claim_view *view, const char *value, unsigned int hash);
+static const char *jwt_claim_in_parse(cmd_parms *cmd, const char *require_line, const void **parsed);
+static authz_status jwt_claim_in_check(request_rec *r, const char *require_line, const void *parsed);
+static apr_status_t allowlist_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s);
+static void allowlist_child_init(apr_pool_t *p, server_rec *s);
+static apr_status_t allowlist_compile(apr_pool_t *p, claim_allowlist *list, apr_time_t mtime);
+static apr_status_t allowlist_compiled_mtime(apr_pool_t *p, claim_allowlist *list, apr_time_t *mtime);
+static apr_status_t allowlist_map(claim_allowlist *list);
+static void allowlist_refresh(request_rec *r, claim_allowlist *list);
+static int allowlist_contains(claim_allowlist *list, const char *value);
+static apr_uint32_t allowlist_slot(apr_uint64_t hash, apr_uint32_t displacement, apr_uint32_t count);
+static int compare_allowlist_value(const void *a, const void *b);
+static const char *jwt_claim_regex_parse(cmd_parms *cmd, const char *require_line, const void **parsed);
+static authz_status jwt_claim_regex_check(request_rec *r, const char *require_line, const void *parsed);
+static apr_status_t regex_code_cleanup(void *data);
+static void regex_child_init(apr_pool_t *p, server_rec *s);
+static regex_state *regex_state_get(void);
+static void regex_state_free(void *data);
+static apr_array_header_t *claim_values(apr_pool_t *p, jwt_t *token, const char *claim);
+static int json_claim_values(apr_pool_t *p, const char *json, apr_array_header_t *values);
+static const char *json_unescape(apr_pool_t *p, const char **json);
+static random_state *random_state_get(void);
+static void random_state_free(void *data);
+static void random_refill(random_state *state);
+static apr_status_t random_bytes(unsigned char *buf, apr_size_t len);
+static int get_leeway(request_rec *r);
+static void token_renew(request_rec *r, const unsigned char *digest, const verified_token *vt);
 
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  DECLARE DIRECTIVES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
@@ -127,8 +1091,48 @@ static const command_rec auth_jwt_cmds[] =
                      "The time delay in seconds before which delivered tokens must not be processed"),
    AP_INIT_TAKE1("AuthJWTLeeway", set_jwt_int_param, (void *)dir_leeway, RSRC_CONF|ACCESS_CONF,
                      "The leeway to account for clock skew in token validation process"),
+   AP_INIT_TAKE1("AuthJWTRenewWindow", set_jwt_int_param, (void *)dir_renew_window, RSRC_CONF|ACCESS_CONF,
+                     "The time in seconds before expiration during which a renewed token is sent along responses (0 to disable)"),
+   AP_INIT_TAKE1("AuthJWTMaxSessionAge", set_jwt_int_param, (void *)dir_max_session_age, RSRC_CONF|ACCESS_CONF,
+                     "The time in seconds after the login past which tokens are no longer renewed (0 for no limit)"),
+   AP_INIT_TAKE1("AuthJWTCacheSize", set_jwt_int_param, (void *)dir_cache_size, RSRC_CONF,
+                     "The number of verified tokens each child keeps in cache (0 to disable)"),
+   AP_INIT_TAKE12("AuthJWTCacheFile", set_cache_file, NULL, RSRC_CONF,
+                     "The file holding verified tokens shared by all children across restarts, and its number of entries"),
+   AP_INIT_TAKE1("AuthJWTSocache", set_socache, NULL, RSRC_CONF,
+                     "The socache provider, and its arguments, used as a second tier cache of verified tokens"),
+   AP_INIT_TAKE1("AuthJWTRevocationTableSize", set_jwt_int_param, (void *)dir_revocation_table_size, RSRC_CONF,
+                     "The number of revoked tokens which can be remembered at once (0 to disable logout)"),
+   AP_INIT_TAKE12("AuthJWTRevocationFile", set_revocation_file, NULL, RSRC_CONF,
+                     "A file listing revoked jti, one per line, and the maximum number of entries"),
+   AP_INIT_TAKE12("AuthJWTUserInvalidationTableSize", set_user_invalidation_table, NULL, RSRC_CONF,
+                     "The number of users whose tokens can be invalidated at once, and the maximum lifetime of tokens in seconds"),
+   AP_INIT_TAKE1("AuthJWTUserInvalidationFile", set_user_invalidation_file, NULL, RSRC_CONF,
+                     "A file of \"user timestamp\" lines: tokens of user issued before timestamp are invalid"),
+   AP_INIT_TAKE12("AuthJWTLoginCache", set_login_cache, NULL, RSRC_CONF,
+                     "The time in seconds during which a successful login is cached, and the number of entries"),
+   AP_INIT_TAKE123("AuthJWTLoginConcurrency", set_login_concurrency, NULL, RSRC_CONF,
+                     "The maximum number of concurrent provider checks, of logins waiting for one, and the wait in milliseconds"),
+   AP_INIT_TAKE3("AuthJWTLoginThrottle", set_login_throttle, NULL, RSRC_CONF,
+                     "Throttles logins per 'ip' or per 'user': number of logins per minute, and burst"),
+   AP_INIT_TAKE1("AuthJWTLoginThrottleTableSize", set_jwt_int_param, (void *)dir_throttle_table_size, RSRC_CONF,
+                     "The number of clients and users whose logins can be throttled at once"),
    AP_INIT_ITERATE("AuthJWTProvider", add_authn_provider, NULL, ACCESS_CONF,
                 "Specify the auth providers for a directory or location"),
+   AP_INIT_FLAG("AuthJWTProviderParallel", set_providers_parallel, NULL, ACCESS_CONF,
+                "Query the auth providers of a directory or location concurrently"),
+   AP_INIT_TAKE1("AuthJWTProviderThreads", set_jwt_int_param, (void *)dir_provider_threads, RSRC_CONF,
+                     "The maximum number of threads of each child querying auth providers concurrently"),
+   AP_INIT_TAKE1("AuthJWTLoginThreads", set_jwt_int_param, (void *)dir_login_threads, RSRC_CONF,
+                     "The maximum number of threads of each child checking logins of suspended requests (0 to disable)"),
+   AP_INIT_TAKE12("AuthJWTRefreshTableSize", set_refresh_table, NULL, RSRC_CONF,
+                     "The number of refresh tokens which can be delivered at once (0 to disable), and their lifetime in seconds"),
+   AP_INIT_TAKE1("AuthJWTMintThreads", set_jwt_int_param, (void *)dir_mint_threads, RSRC_CONF,
+                     "The maximum number of threads of each child signing tokens of bulk issuances (0 to sign on the request thread)"),
+   AP_INIT_ITERATE("AuthJWTMintUsers", add_mint_user, NULL, ACCESS_CONF,
+                "The authenticated users allowed to use the jwt-mint-handler of a directory or location"),
+   AP_INIT_ITERATE("AuthJWTInvalidateUsers", add_invalidate_user, NULL, ACCESS_CONF,
+                "The authenticated users allowed to invalidate the tokens of other users with the jwt-invalidate-handler"),
     {NULL}
 };
 
@@ -160,6 +1164,18 @@ static void *create_auth_jwt_dir_config(apr_pool_t *p, char *d){
 static void *create_auth_jwt_config(apr_pool_t * p, server_rec *s){
     auth_jwt_config_rec *conf = (auth_jwt_config_rec*) apr_pcalloc(p, sizeof(*conf));
 
+    conf->cache_size = DEFAULT_CACHE_SIZE;
+    conf->cache_file_entries = DEFAULT_CACHE_FILE_ENTRIES;
+    conf->revocation_table_size = DEFAULT_REVOCATION_TABLE_SIZE;
+    conf->revocation_file_entries = DEFAULT_REVOCATION_LIST_SIZE;
+    conf->user_invalidation_table_size = DEFAULT_USER_INVALIDATION_TABLE_SIZE;
+    conf->user_invalidation_lifetime = DEFAULT_USER_INVALIDATION_LIFETIME;
+    conf->login_cache_size = DEFAULT_LOGIN_CACHE_SIZE;
+    conf->login_wait = DEFAULT_LOGIN_WAIT;
+    conf->throttle_table_size = DEFAULT_THROTTLE_TABLE_SIZE;
+    conf->provider_threads = DEFAULT_PROVIDER_THREADS;
+    conf->refresh_lifetime = DEFAULT_REFRESH_LIFETIME;
+
     conf->signature_algorithm_set = 0;
     conf->signature_secret_set = 0;
     conf->exp_delay_set = 0;
@@ -168,6 +1184,7 @@ static void *create_auth_jwt_config(apr_pool_t * p, server_rec *s){
     conf->iss_set = 0;
     conf->aud_set = 0;
     conf->sub_set = 0;
+    conf->cache_size_set = 0;
 
     return (void *)conf;
 }
@@ -268,6 +1285,24 @@ static void* get_config_value(request_rec *r, jwt_directive directive){
                 return NULL;
             }
             break;
+        case dir_renew_window:
+            if(dconf->renew_window_set){
+                value = (void*)&dconf->renew_window;
+            }else if(sconf->renew_window_set){
+                value = (void*)&sconf->renew_window;
+            }else{
+                return NULL;
+            }
+            break;
+        case dir_max_session_age:
+            if(dconf->max_session_age_set){
+                value = (void*)&dconf->max_session_age;
+            }else if(sconf->max_session_age_set){
+                value = (void*)&sconf->max_session_age;
+            }else{
+                return NULL;
+            }
+            break;
         default:
             return NULL;
     }
@@ -277,10 +1312,66 @@ static void* get_config_value(request_rec *r, jwt_directive directive){
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  REGISTER HOOKS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
 
+static const authz_provider authz_jwt_claim_provider = {
+    &jwt_claim_check,
+    &jwt_claim_parse,
+};
+
+static const authz_provider authz_jwt_scope_provider = {
+    &jwt_mask_check,
+    &jwt_scope_parse,
+};
+
+static const authz_provider authz_jwt_role_provider = {
+    &jwt_mask_check,
+    &jwt_role_parse,
+};
+
+static const authz_provider authz_jwt_claim_in_provider = {
+    &jwt_claim_in_check,
+    &jwt_claim_in_parse,
+};
+
+static const authz_provider authz_jwt_claim_regex_provider = {
+    &jwt_claim_regex_check,
+    &jwt_claim_regex_parse,
+};
+
 static void register_hooks(apr_pool_t * p){
   ap_hook_handler(auth_jwt_login_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(auth_jwt_logout_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(auth_jwt_invalidate_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(auth_jwt_mint_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(auth_jwt_refresh_handler, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_check_authn(auth_jwt_authn_with_token, NULL, NULL, APR_HOOK_MIDDLE,
                         AP_AUTH_INTERNAL_PER_CONF);
+  ap_register_auth_provider(p, AUTHZ_PROVIDER_GROUP, "jwt-claim",
+                            AUTHZ_PROVIDER_VERSION,
+                            &authz_jwt_claim_provider,
+                            AP_AUTH_INTERNAL_PER_CONF);
+  ap_register_auth_provider(p, AUTHZ_PROVIDER_GROUP, "jwt-scope",
+                            AUTHZ_PROVIDER_VERSION,
+                            &authz_jwt_scope_provider,
+                            AP_AUTH_INTERNAL_PER_CONF);
+  ap_register_auth_provider(p, AUTHZ_PROVIDER_GROUP, "jwt-role",
+                            AUTHZ_PROVIDER_VERSION,
+                            &authz_jwt_role_provider,
+                            AP_AUTH_INTERNAL_PER_CONF);
+  ap_register_auth_provider(p, AUTHZ_PROVIDER_GROUP, "jwt-claim-in",
+                            AUTHZ_PROVIDER_VERSION,
+                            &authz_jwt_claim_in_provider,
+                            AP_AUTH_INTERNAL_PER_CONF);
+  ap_register_auth_provider(p, AUTHZ_PROVIDER_GROUP, "jwt-claim-regex",
+                            AUTHZ_PROVIDER_VERSION,
+                            &authz_jwt_claim_regex_provider,
+                            AP_AUTH_INTERNAL_PER_CONF);
+  ap_hook_pre_connection(auth_jwt_pre_connection, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_pre_config(auth_jwt_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_post_config(auth_jwt_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_child_init(auth_jwt_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+  ap_hook_suspend_connection(auth_jwt_suspend_connection, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
 }
 
 
@@ -339,10 +1430,12 @@ static const char *set_jwt_param(cmd_parms * cmd, void* config, const char* valu
         case dir_signature_algorithm:
             conf->signature_algorithm = value;
             conf->signature_algorithm_set = 1;
+            apr_sha1_update(&key_set_context, value, strlen(value) + 1);
         break;
         case dir_signature_secret:
             conf->signature_secret = value;
             conf->signature_secret_set = 1;
+            apr_sha1_update(&key_set_context, value, strlen(value) + 1);
         break;
         case dir_iss:
             conf->iss = value;
@@ -356,58 +1449,317 @@ static const char *set_jwt_param(cmd_parms * cmd, void* config, const char* valu
             conf->sub = value;
             conf->sub_set = 1;
         break;
+        default:
+        break;
     }
 
   return NULL;
 }
 
-static const char *set_jwt_int_param(cmd_parms * cmd, void* config, const char* value){
+static const char *set_cache_file(cmd_parms * cmd, void* config, const char* path, const char* entries){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
 
-    auth_jwt_config_rec *conf;
-    if(!cmd->path){
-        conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
-    }else{
-        conf = (auth_jwt_config_rec *) config;
+    conf->cache_file = ap_server_root_relative(cmd->pool, path);
+    if(!conf->cache_file){
+        return apr_pstrcat(cmd->pool, "Invalid AuthJWTCacheFile path ", path, NULL);
+    }
+
+    if(entries){
+        const char *digit;
+        for (digit = entries; *digit; ++digit) {
+            if (!apr_isdigit(*digit)) {
+                return "Number of entries must be numeric!";
+            }
+        }
+        conf->cache_file_entries = atoi(entries);
+        if(conf->cache_file_entries <= 0){
+            return "Number of entries must be positive!";
+        }
+    }
+    return NULL;
+}
+
+static const char *set_revocation_file(cmd_parms * cmd, void* config, const char* path, const char* entries){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+
+    conf->revocation_file = ap_server_root_relative(cmd->pool, path);
+    if(!conf->revocation_file){
+        return apr_pstrcat(cmd->pool, "Invalid AuthJWTRevocationFile path ", path, NULL);
+    }
+
+    if(entries){
+        const char *digit;
+        for (digit = entries; *digit; ++digit) {
+            if (!apr_isdigit(*digit)) {
+                return "Number of entries must be numeric!";
+            }
+        }
+        conf->revocation_file_entries = atoi(entries);
+        if(conf->revocation_file_entries <= 0){
+            return "Number of entries must be positive!";
+        }
     }
+    return NULL;
+}
 
+static const char *set_refresh_table(cmd_parms * cmd, void* config, const char* entries, const char* lifetime){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
     const char *digit;
-    for (digit = value; *digit; ++digit) {
+
+    for (digit = entries; *digit; ++digit) {
         if (!apr_isdigit(*digit)) {
-            return "Argument must be numeric!";
+            return "Number of entries must be numeric!";
         }
     }
+    conf->refresh_table_size = atoi(entries);
 
-    switch ((long) cmd->info) {
-        case dir_exp_delay:
-            conf->exp_delay = atoi(value);
-            conf->exp_delay_set = 1;
-        break;
-        case dir_nbf_delay:
-            conf->nbf_delay = atoi(value);
-            conf->nbf_delay_set = 1;
-        break;
-        case dir_leeway:
-            conf->leeway = atoi(value);
-            conf->leeway_set = 1;
-        break;
+    if(lifetime){
+        for (digit = lifetime; *digit; ++digit) {
+            if (!apr_isdigit(*digit)) {
+                return "Lifetime must be numeric!";
+            }
+        }
+        conf->refresh_lifetime = atoi(lifetime);
     }
     return NULL;
 }
 
+static const char *set_user_invalidation_table(cmd_parms * cmd, void* config, const char* entries, const char* lifetime){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+    const char *digit;
 
-/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  AUTHENTICATION HANDLERS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+    for (digit = entries; *digit; ++digit) {
+        if (!apr_isdigit(*digit)) {
+            return "Number of entries must be numeric!";
+        }
+    }
+    conf->user_invalidation_table_size = atoi(entries);
 
+    if(lifetime){
+        for (digit = lifetime; *digit; ++digit) {
+            if (!apr_isdigit(*digit)) {
+                return "Lifetime must be numeric!";
+            }
+        }
+        conf->user_invalidation_lifetime = atoi(lifetime);
+    }
+    return NULL;
+}
 
-static int auth_jwt_login_handler(request_rec *r){
+static const char *set_user_invalidation_file(cmd_parms * cmd, void* config, const char* path){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
 
-  if(!r->handler || strcmp(r->handler, JWT_LOGIN_HANDLER)){
-    return DECLINED;
-  }
+    conf->user_invalidation_file = ap_server_root_relative(cmd->pool, path);
+    if(!conf->user_invalidation_file){
+        return apr_pstrcat(cmd->pool, "Invalid AuthJWTUserInvalidationFile path ", path, NULL);
+    }
+    return NULL;
+}
+
+static const char *set_login_cache(cmd_parms * cmd, void* config, const char* ttl, const char* entries){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+    const char *digit;
+
+    for (digit = ttl; *digit; ++digit) {
+        if (!apr_isdigit(*digit)) {
+            return "Time to live must be numeric!";
+        }
+    }
+    conf->login_cache_ttl = atoi(ttl);
+
+    if(entries){
+        for (digit = entries; *digit; ++digit) {
+            if (!apr_isdigit(*digit)) {
+                return "Number of entries must be numeric!";
+            }
+        }
+        conf->login_cache_size = atoi(entries);
+    }
+    return NULL;
+}
+
+static const char *set_login_concurrency(cmd_parms * cmd, void* config, const char* max, const char* queue, const char* wait){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+    const char* values[] = {max, queue, wait};
+    const char *digit;
+    int i;
+
+    for(i=0;i<3;i++){
+        if(!values[i]){
+            continue;
+        }
+        for (digit = values[i]; *digit; ++digit) {
+            if (!apr_isdigit(*digit)) {
+                return "Arguments must be numeric!";
+            }
+        }
+    }
+    conf->login_concurrency = atoi(max);
+    conf->login_queue = queue ? atoi(queue) : conf->login_concurrency;
+    if(wait){
+        conf->login_wait = atoi(wait);
+    }
+    return NULL;
+}
+
+static const char *set_login_throttle(cmd_parms * cmd, void* config, const char* key, const char* rate, const char* burst){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+    const char *digit;
+
+    for (digit = rate; *digit; ++digit) {
+        if (!apr_isdigit(*digit)) {
+            return "Rate must be numeric!";
+        }
+    }
+    for (digit = burst; *digit; ++digit) {
+        if (!apr_isdigit(*digit)) {
+            return "Burst must be numeric!";
+        }
+    }
+
+    if(!strcasecmp(key, "ip")){
+        conf->throttle_ip_rate = atoi(rate);
+        conf->throttle_ip_burst = atoi(burst);
+    }else if(!strcasecmp(key, "user")){
+        conf->throttle_user_rate = atoi(rate);
+        conf->throttle_user_burst = atoi(burst);
+    }else{
+        return "First argument must be 'ip' or 'user'";
+    }
+    return NULL;
+}
+
+static const char *add_mint_user(cmd_parms * cmd, void* config, const char* user){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) config;
+    if(!conf->mint_users){
+        conf->mint_users = apr_array_make(cmd->pool, 4, sizeof(const char *));
+    }
+    APR_ARRAY_PUSH(conf->mint_users, const char *) = user;
+    return NULL;
+}
+
+static const char *add_invalidate_user(cmd_parms * cmd, void* config, const char* user){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) config;
+    if(!conf->invalidate_users){
+        conf->invalidate_users = apr_array_make(cmd->pool, 4, sizeof(const char *));
+    }
+    APR_ARRAY_PUSH(conf->invalidate_users, const char *) = user;
+    return NULL;
+}
+
+static int user_listed(const apr_array_header_t *users, const char *user){
+    int i;
+    for(i = 0; users && i < users->nelts; i++){
+        if(!strcmp(APR_ARRAY_IDX(users, i, const char *), user)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char *set_providers_parallel(cmd_parms * cmd, void* config, int flag){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) config;
+    conf->providers_parallel = flag;
+#if APR_HAS_THREADS
+    if(flag){
+        providers_parallel_used = 1;
+    }
+#else
+    if(flag){
+        return "AuthJWTProviderParallel requires threads support";
+    }
+#endif
+    return NULL;
+}
+
+static const char *set_socache(cmd_parms * cmd, void* config, const char* arg){
+    auth_jwt_config_rec *conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+    const char *sep = ap_strchr_c(arg, ':');
+    const char *name = sep ? apr_pstrmemdup(cmd->pool, arg, sep - arg) : arg;
+
+    conf->socache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                                                AP_SOCACHE_PROVIDER_VERSION);
+    if(!conf->socache_provider){
+        return apr_psprintf(cmd->pool,
+                            "Unknown socache provider '%s'. Maybe you need to load the "
+                            "appropriate socache module (mod_socache_%s?)", name, name);
+    }
+    conf->socache_args = sep ? sep + 1 : NULL;
+    return NULL;
+}
+
+static const char *set_jwt_int_param(cmd_parms * cmd, void* config, const char* value){
+
+    auth_jwt_config_rec *conf;
+    if(!cmd->path){
+        conf = (auth_jwt_config_rec *) ap_get_module_config(cmd->server->module_config, &auth_jwt_module);
+    }else{
+        conf = (auth_jwt_config_rec *) config;
+    }
+
+    const char *digit;
+    for (digit = value; *digit; ++digit) {
+        if (!apr_isdigit(*digit)) {
+            return "Argument must be numeric!";
+        }
+    }
+
+    switch ((long) cmd->info) {
+        case dir_exp_delay:
+            conf->exp_delay = atoi(value);
+            conf->exp_delay_set = 1;
+        break;
+        case dir_nbf_delay:
+            conf->nbf_delay = atoi(value);
+            conf->nbf_delay_set = 1;
+        break;
+        case dir_leeway:
+            conf->leeway = atoi(value);
+            conf->leeway_set = 1;
+        break;
+        case dir_renew_window:
+            conf->renew_window = atoi(value);
+            conf->renew_window_set = 1;
+        break;
+        case dir_max_session_age:
+            conf->max_session_age = atoi(value);
+            conf->max_session_age_set = 1;
+        break;
+        case dir_cache_size:
+            conf->cache_size = atoi(value);
+            conf->cache_size_set = 1;
+        break;
+        case dir_revocation_table_size:
+            conf->revocation_table_size = atoi(value);
+            conf->revocation_table_size_set = 1;
+        break;
+        case dir_throttle_table_size:
+            conf->throttle_table_size = atoi(value);
+        break;
+        case dir_provider_threads:
+            conf->provider_threads = atoi(value);
+        break;
+        case dir_login_threads:
+            conf->login_threads = atoi(value);
+        break;
+        case dir_mint_threads:
+            conf->mint_threads = atoi(value);
+        break;
+    }
+    return NULL;
+}
+
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  AUTHENTICATION HANDLERS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+
+static int auth_jwt_login_handler(request_rec *r){
+
+  if(!r->handler || strcmp(r->handler, JWT_LOGIN_HANDLER)){
+    return DECLINED;
+  }
 
   int res;
-  char* buffer;
-  apr_off_t len;
-  apr_size_t size;
   int rv;
 
   if(r->method_number != M_POST){
@@ -417,319 +1769,4514 @@ static int auth_jwt_login_handler(request_rec *r){
     return HTTP_METHOD_NOT_ALLOWED;
   }
 
-  apr_array_header_t *pairs = NULL;
-  res = ap_parse_form_data(r, NULL, &pairs, -1, FORM_SIZE);
+  auth_jwt_config_rec *sconf = (auth_jwt_config_rec *) ap_get_module_config(r->server->module_config,
+                                                  &auth_jwt_module);
+
+  /* throttled clients are rejected before their request body is even read */
+  res = throttle_check(r, "ip", r->useragent_ip, sconf->throttle_ip_rate, sconf->throttle_ip_burst);
   if (res != OK) {
     return res;
   }
-  char* fields_name[] = {"user", "password"};
-  char* fields[] = {fields_name[USER_INDEX], fields_name[PASSWORD_INDEX]};
 
-  char* sent_values[2];
+  const char *sent_values[2];
+  res = login_credentials(r, &sent_values[USER_INDEX], &sent_values[PASSWORD_INDEX]);
+  if (res != OK) {
+    return res;
+  }
 
-  int i;
-  while (pairs && !apr_is_empty_array(pairs)) {
-    ap_form_pair_t *pair = (ap_form_pair_t *) apr_array_pop(pairs);
-    for(i=0;i<2;i++){
-      if (fields[i] && !strcmp(pair->name, fields[i]) && &sent_values[i]) {
-        apr_brigade_length(pair->value, 1, &len);
-        size = (apr_size_t) len;
-        buffer = apr_palloc(r->pool, size + 1);
-        apr_brigade_flatten(pair->value, buffer, &size);
-        buffer[len] = 0;
-        sent_values[i] = buffer;
+  r->user = apr_pstrdup(r->pool, sent_values[USER_INDEX]);
 
-      }
-    }
+  rv = throttle_check(r, "user", sent_values[USER_INDEX], sconf->throttle_user_rate, sconf->throttle_user_burst);
+  if (rv != OK) {
+    return rv;
   }
 
-  for(i=0;i<2;i++){
-    if(!sent_values[i]){
-      return HTTP_UNAUTHORIZED;
-    }
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+  if(login_pool){
+    return login_suspend(r, sent_values[USER_INDEX], sent_values[PASSWORD_INDEX]);
   }
-
-  r->user = sent_values[USER_INDEX];
+#endif
 
   rv = check_authn(r, sent_values[USER_INDEX], sent_values[PASSWORD_INDEX]);
+  return login_respond(r, rv, sent_values[USER_INDEX]);
+}
 
-  if(rv == OK){
-    char* token;
-    rv = create_token(r, &token, sent_values[USER_INDEX]);
-    if(rv == OK){
-      apr_table_setn(r->err_headers_out, "Content-Type", "application/json");
-      ap_rprintf(r, "{\"token\":\"%s\"}", token);
-      free(token);
-    }
+/*
+Reads the credentials of a login from an Authorization: Basic header, or from
+a application/x-www-form-urlencoded or application/json body, which is parsed
+as it is read and only until both fields are found.
+*/
+static int login_credentials(request_rec *r, const char **username, const char **password){
+  static const char *fields[] = {"user", "password"};
+  const char *authorization = apr_table_get(r->headers_in, "Authorization");
+  const char *values[2];
+  int rv;
+
+  if(authorization && !strncasecmp(authorization, "Basic ", 6)){
+    return login_basic_credentials(r, authorization + 6, username, password);
   }
 
-  return rv;
+  rv = read_fields(r, fields, 2, values);
+  if(rv == DECLINED){
+    return HTTP_UNAUTHORIZED;
+  }else if(rv != OK){
+    return rv;
+  }
+  *username = values[USER_INDEX];
+  *password = values[PASSWORD_INDEX];
+  return OK;
 }
 
+/*
+Reads the values of count fields (two at most) of a form or JSON body, which is
+parsed as it is read and only until all the fields are found. Returns DECLINED
+when a field is missing, its value being NULL.
+*/
+static int read_fields(request_rec *r, const char **fields, int count, const char **values){
+  const char *content_type = apr_table_get(r->headers_in, "Content-Type");
+  login_parser *parser;
+  apr_bucket_brigade *bb;
+  apr_off_t total = 0;
+  int seen_eos = 0, done = 0, missing = 0;
+  int i;
 
-static int create_token(request_rec *r, char** token_str, const char* username){
-    jwt_t *token;
-    int allocate = token_new(&token);
+  parser = apr_pcalloc(r->pool, sizeof(login_parser));
+  parser->fields = fields;
+  parser->count = count;
+  if(content_type && !strncasecmp(content_type, "application/x-www-form-urlencoded", 33)){
+    parser->format = login_form;
+    parser->state = login_form_key;
+  }else if(content_type && !strncasecmp(content_type, "application/json", 16)){
+    parser->format = login_json;
+    parser->state = login_json_start;
+  }else{
+    return HTTP_UNSUPPORTED_MEDIA_TYPE;
+  }
 
-    char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
-    char* signature_algorithm = (char *)get_config_value(r, dir_signature_algorithm);
-    char* iss = (char *)get_config_value(r, dir_iss);
-    char* aud = (char *)get_config_value(r, dir_aud);
-    char* sub = (char *)get_config_value(r, dir_sub);
-    int* exp_delay_ptr = (int*)get_config_value(r, dir_exp_delay);
-    int* nbf_delay_ptr = (int*)get_config_value(r, dir_nbf_delay);
+  bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  while(!seen_eos && !done){
+    apr_bucket *bucket;
+    apr_status_t rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, HUGE_STRING_LEN);
+    if(rv != APR_SUCCESS){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01810)
+                    "Cannot read request body");
+      return ap_map_http_request_error(rv, HTTP_BAD_REQUEST);
+    }
 
-    if(!signature_secret){
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                      "You must specify AuthJWTSignatureSecret directive in configuration");
-        return HTTP_INTERNAL_SERVER_ERROR;
+    for(bucket = APR_BRIGADE_FIRST(bb); !done && bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)){
+      const char *data;
+      apr_size_t len;
+
+      if(APR_BUCKET_IS_EOS(bucket)){
+        seen_eos = 1;
+        break;
+      }
+      if(APR_BUCKET_IS_METADATA(bucket)){
+        continue;
+      }
+      if(apr_bucket_read(bucket, &data, &len, APR_BLOCK_READ) != APR_SUCCESS){
+        return HTTP_BAD_REQUEST;
+      }
+      total += len;
+      if(total > FORM_SIZE){
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+      }
+      done = login_parse(parser, data, len);
+      if(done < 0){
+        return HTTP_BAD_REQUEST;
+      }
     }
+    apr_brigade_cleanup(bb);
+  }
 
-    if(!signature_algorithm){
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-            "Cannot retrieve specified signature algorithm. This error should not happen since a default algorithm is set.");
-        return HTTP_INTERNAL_SERVER_ERROR;
+  /* a form value ends with the body */
+  if(parser->format == login_form && parser->state == login_form_value && parser->field >= 0){
+    parser->found[parser->field] = 1;
+  }
+  for(i = 0; i < count; i++){
+    if(!parser->found[i]){
+      values[i] = NULL;
+      missing = 1;
+      continue;
+    }
+    parser->values[i][parser->lens[i]] = 0;
+    if(parser->format == login_form && ap_unescape_urlencoded(parser->values[i]) != OK){
+      return HTTP_BAD_REQUEST;
     }
+    values[i] = parser->values[i];
+  }
+  return missing ? DECLINED : OK;
+}
 
+static int login_basic_credentials(request_rec *r, const char *authorization, const char **username, const char **password){
+  char *decoded, *sep;
+  int len;
 
-    if(check_key_length(r, signature_secret, signature_algorithm)!=OK){
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+  while(apr_isspace(*authorization)){
+    authorization++;
+  }
+  if(strlen(authorization) > 2 * FORM_SIZE){
+    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+  }
+  decoded = apr_palloc(r->pool, apr_base64_decode_len(authorization) + 1);
+  len = apr_base64_decode(decoded, authorization);
+  decoded[len] = 0;
 
-    if(!strcmp(signature_algorithm, "HS512")){
-        token_set_alg(token, JWT_ALG_HS512, (unsigned char*)signature_secret, 64);
-    }else if(!strcmp(signature_algorithm, "HS384")){
-        token_set_alg(token, JWT_ALG_HS256, (unsigned char*)signature_secret, 48);
-    }else if(!strcmp(signature_algorithm, "HS256")){
-        token_set_alg(token, JWT_ALG_HS256, (unsigned char*)signature_secret, 32);
-    }else{
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+  sep = strchr(decoded, ':');
+  if(!sep){
+    return HTTP_BAD_REQUEST;
+  }
+  *sep = 0;
+  *username = decoded;
+  *password = sep + 1;
+  return OK;
+}
 
-    time_t now = time(NULL);
-    time_t iat = now;
-    time_t exp = now;
-    time_t nbf = now;
+/* Feeds data to the parser: 1 once all the fields are found, -1 on syntax error */
+static int login_parse(login_parser *parser, const char *data, apr_size_t len){
+  apr_size_t i;
+
+  for(i = 0; i < len; i++){
+    char c = data[i];
+
+    switch(parser->state){
+      case login_form_key:
+        if(c == '='){
+          login_parser_end_key(parser);
+          parser->state = login_form_value;
+        }else if(c == '&'){
+          parser->key_len = 0;
+        }else if(parser->key_len < LOGIN_KEY_SIZE){
+          parser->key[parser->key_len++] = c;
+        }
+      break;
+      case login_form_value:
+        if(c == '&'){
+          if(parser->field >= 0){
+            parser->found[parser->field] = 1;
+          }
+          parser->key_len = 0;
+          parser->state = login_form_key;
+        }else{
+          login_parser_append(parser, c);
+        }
+      break;
 
-    char time_buffer_str[11];
-    if(exp_delay_ptr && *exp_delay_ptr >= 0){
-        exp += *exp_delay_ptr;
-        sprintf(time_buffer_str, "%ld", exp);
-        token_add_claim(token, "exp", time_buffer_str);
+      case login_json_start:
+        if(c == '{'){
+          parser->state = login_json_key_or_end;
+        }else if(!apr_isspace(c)){
+          return -1;
+        }
+      break;
+      case login_json_key_or_end:
+        if(c == '"'){
+          parser->key_len = 0;
+          parser->state = login_json_key;
+        }else if(c == '}'){
+          parser->state = login_json_end;
+        }else if(!apr_isspace(c)){
+          return -1;
+        }
+      break;
+      case login_json_key:
+        if(parser->escape){
+          /* escaped keys are not ours */
+          parser->escape = 0;
+          parser->key_len = LOGIN_KEY_SIZE;
+        }else if(c == '\\'){
+          parser->escape = 1;
+        }else if(c == '"'){
+          login_parser_end_key(parser);
+          parser->state = login_json_colon;
+        }else if(parser->key_len < LOGIN_KEY_SIZE){
+          parser->key[parser->key_len++] = c;
+        }
+      break;
+      case login_json_colon:
+        if(c == ':'){
+          parser->state = login_json_value;
+        }else if(!apr_isspace(c)){
+          return -1;
+        }
+      break;
+      case login_json_value:
+        if(c == '"'){
+          parser->state = login_json_string;
+        }else if(c == '{' || c == '['){
+          parser->depth = 1;
+          parser->in_string = 0;
+          parser->escape = 0;
+          parser->state = login_json_nested;
+        }else if(!apr_isspace(c)){
+          /* numbers, booleans and null are not credentials */
+          parser->field = -1;
+          parser->state = login_json_scalar;
+        }
+      break;
+      case login_json_string:
+        if(c == '"'){
+          if(parser->field >= 0){
+            parser->found[parser->field] = 1;
+          }
+          parser->state = login_json_after_value;
+        }else if(c == '\\'){
+          parser->state = login_json_escape;
+        }else{
+          login_parser_append(parser, c);
+        }
+      break;
+      case login_json_escape:
+        parser->state = login_json_string;
+        switch(c){
+          case 'b': login_parser_append(parser, '\b'); break;
+          case 'f': login_parser_append(parser, '\f'); break;
+          case 'n': login_parser_append(parser, '\n'); break;
+          case 'r': login_parser_append(parser, '\r'); break;
+          case 't': login_parser_append(parser, '\t'); break;
+          case 'u':
+            parser->unicode = 0;
+            parser->unicode_digits = 0;
+            parser->state = login_json_unicode;
+          break;
+          default: login_parser_append(parser, c); break;
+        }
+      break;
+      case login_json_unicode:
+        if(!apr_isxdigit(c)){
+          return -1;
+        }
+        parser->unicode = (parser->unicode << 4)
+                        | (apr_isdigit(c) ? c - '0' : (apr_tolower(c) - 'a' + 10));
+        if(++parser->unicode_digits == 4){
+          login_parser_append_unicode(parser, parser->unicode);
+          parser->state = login_json_string;
+        }
+      break;
+      case login_json_scalar:
+        if(c == ','){
+          parser->state = login_json_key_or_end;
+        }else if(c == '}'){
+          parser->state = login_json_end;
+        }
+      break;
+      case login_json_nested:
+        if(parser->in_string){
+          if(parser->escape){
+            parser->escape = 0;
+          }else if(c == '\\'){
+            parser->escape = 1;
+          }else if(c == '"'){
+            parser->in_string = 0;
+          }
+        }else if(c == '"'){
+          parser->in_string = 1;
+        }else if(c == '{' || c == '['){
+          parser->depth++;
+        }else if((c == '}' || c == ']') && --parser->depth == 0){
+          parser->state = login_json_after_value;
+        }
+      break;
+      case login_json_after_value:
+        if(c == ','){
+          parser->state = login_json_key_or_end;
+        }else if(c == '}'){
+          parser->state = login_json_end;
+        }else if(!apr_isspace(c)){
+          return -1;
+        }
+      break;
+      case login_json_end:
+        if(!apr_isspace(c)){
+          return -1;
+        }
+      break;
     }
 
-    if(nbf_delay_ptr && *nbf_delay_ptr >= 0){
-        nbf += *nbf_delay_ptr;
-        sprintf(time_buffer_str, "%ld", nbf);
-        token_add_claim(token, "nbf", time_buffer_str);
+    if(parser->found[0] && (parser->count < 2 || parser->found[1])){
+      return 1;
     }
+  }
+  return 0;
+}
 
-    sprintf(time_buffer_str, "%ld", iat);
-    token_add_claim(token, "iat", time_buffer_str);
+/* Selects the field whose value comes next, the first occurrence of a field wins */
+static void login_parser_end_key(login_parser *parser){
+  char key[LOGIN_KEY_SIZE + 1];
+  int i;
 
-    if(iss){
-        token_add_claim(token, "iss", iss);
+  parser->field = -1;
+  parser->surrogate = 0;
+  if(parser->key_len >= LOGIN_KEY_SIZE){
+    return;
+  }
+  memcpy(key, parser->key, parser->key_len);
+  key[parser->key_len] = 0;
+  if(parser->format == login_form && ap_unescape_urlencoded(key) != OK){
+    return;
+  }
+  for(i = 0; i < parser->count; i++){
+    if(!strcmp(key, parser->fields[i]) && !parser->found[i]){
+      parser->field = i;
+      parser->lens[i] = 0;
     }
+  }
+}
 
-    if(sub){
-        token_add_claim(token, "sub", sub);
-    }
+static void login_parser_append(login_parser *parser, char c){
+  if(parser->field >= 0 && parser->lens[parser->field] < FORM_SIZE){
+    parser->values[parser->field][parser->lens[parser->field]++] = c;
+  }
+}
 
-    if(aud){
-        token_add_claim(token, "aud", aud);
+/* Appends a \u escape as UTF-8, pairing surrogates */
+static void login_parser_append_unicode(login_parser *parser, apr_uint32_t code){
+  if(code >= 0xD800 && code <= 0xDBFF){
+    parser->surrogate = code;
+    return;
+  }
+  if(code >= 0xDC00 && code <= 0xDFFF){
+    if(!parser->surrogate){
+      code = 0xFFFD;
+    }else{
+      code = 0x10000 + ((parser->surrogate - 0xD800) << 10) + (code - 0xDC00);
     }
+  }
+  parser->surrogate = 0;
+
+  if(code < 0x80){
+    login_parser_append(parser, (char)code);
+  }else if(code < 0x800){
+    login_parser_append(parser, (char)(0xC0 | (code >> 6)));
+    login_parser_append(parser, (char)(0x80 | (code & 0x3F)));
+  }else if(code < 0x10000){
+    login_parser_append(parser, (char)(0xE0 | (code >> 12)));
+    login_parser_append(parser, (char)(0x80 | ((code >> 6) & 0x3F)));
+    login_parser_append(parser, (char)(0x80 | (code & 0x3F)));
+  }else{
+    login_parser_append(parser, (char)(0xF0 | (code >> 18)));
+    login_parser_append(parser, (char)(0x80 | ((code >> 12) & 0x3F)));
+    login_parser_append(parser, (char)(0x80 | ((code >> 6) & 0x3F)));
+    login_parser_append(parser, (char)(0x80 | (code & 0x3F)));
+  }
+}
 
-    token_add_claim(token, "user", username);
+/* Sends a token to a user whose login was checked with result rv */
+static int login_respond(request_rec *r, int rv, const char *username){
+  const char *refresh_token = NULL;
 
-    *token_str = token_encode_str(token);
-    token_free(token);
-    return OK;
+  if(rv != OK){
+    return rv;
+  }
+  if(refresh_table.buckets){
+    refresh_token = refresh_table_issue(r, username);
+  }
+  return token_respond(r, username, refresh_token);
 }
 
-static int check_authn(request_rec *r, const char *username, const char *password){
-    authn_status authn_result;
-    authn_provider_list *current_provider;
-    auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config,
-                                                      &auth_jwt_module);
+/* Sends a new token for username, and the refresh token if any */
+static int token_respond(request_rec *r, const char *username, const char *refresh_token){
+  char *body;
+  apr_size_t len;
+  apr_bucket_brigade *bb;
+  apr_status_t status;
+  int rv;
 
-    current_provider = conf->providers;
-    do {
-        const authn_provider *provider;
+  /* the token is written in place in the response body */
+  rv = token_write(r, username, 0, "{\"token\":\"",
+                   refresh_token ? apr_pstrcat(r->pool, "\",\"refresh_token\":\"", refresh_token, "\"}", NULL) : "\"}",
+                   &body, &len);
+  if(rv != OK){
+    return rv;
+  }
 
-        if (!current_provider) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01806)
-                          "no authn provider configured");
-            authn_result = AUTH_GENERAL_ERROR;
-            break;
+  ap_set_content_type(r, "application/json");
+  ap_set_content_length(r, len);
+  bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_pool_create(body, len, r->pool, r->connection->bucket_alloc));
+  status = ap_pass_brigade(r->output_filters, bb);
+  if(status != APR_SUCCESS){
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, status, r, APLOGNO(01810)
+                  "Cannot send token of %s", username);
+    return AP_FILTER_ERROR;
+  }
+  return OK;
+}
+
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+/*
+Suspends the request until its login is checked on login_pool. Subrequests and
+HTTP/2 streams cannot be suspended, their login is checked at once.
+*/
+static int login_suspend(request_rec *r, const char *username, const char *password){
+  login_task *task;
+  int rv;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+  if(r->main || r->connection->master){
+#else
+  if(r->main){
+#endif
+    rv = check_authn(r, username, password);
+    return login_respond(r, rv, username);
+  }
+
+  task = apr_pcalloc(r->pool, sizeof(login_task));
+  task->r = r;
+  task->username = username;
+  task->password = password;
+  apr_pool_userdata_setn(task, LOGIN_TASK_KEY, NULL, r->pool);
+  return SUSPENDED;
+}
+
+/* Called by the MPM once it has suspended the connection: the login can go on */
+static void auth_jwt_suspend_connection(conn_rec *c, request_rec *r){
+  login_task *task = NULL;
+
+  if(!r || !login_pool){
+    return;
+  }
+  apr_pool_userdata_get((void **)&task, LOGIN_TASK_KEY, r->pool);
+  if(!task){
+    return;
+  }
+  apr_pool_userdata_setn(NULL, LOGIN_TASK_KEY, NULL, r->pool);
+
+  if(apr_thread_pool_push(login_pool, login_resume, task, APR_THREAD_TASK_PRIORITY_NORMAL, NULL) != APR_SUCCESS){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                  "Cannot queue login of %s, checking it at once", task->username);
+    login_resume(NULL, task);
+  }
+}
+
+static void *APR_THREAD_FUNC login_resume(apr_thread_t *thread, void *data){
+  login_task *task = (login_task *)data;
+  request_rec *r = task->r;
+  int rv;
+
+  rv = check_authn(r, task->username, task->password);
+  rv = login_respond(r, rv, task->username);
+  if(rv == OK || rv == DONE){
+    ap_finalize_request_protocol(r);
+  }else{
+    ap_die(rv, r);
+  }
+
+  ap_mpm_resume_suspended(r->connection);
+  /* r is gone once the request is over */
+  ap_process_request_after_handler(r);
+  return NULL;
+}
+#endif
+
+
+static int create_token(request_rec *r, char** token_str, const char* username, apr_time_t auth_time){
+    apr_size_t len;
+    return token_write(r, username, auth_time, "", "", token_str, &len);
+}
+
+/*
+Writes a new token for username into a single buffer, between prefix and suffix.
+auth_time is the time of the login the token descends from, 0 for a new login.
+*/
+static int token_write(request_rec *r, const char *username, apr_time_t auth_time, const char *prefix, const char *suffix, char **out, apr_size_t *out_len){
+    const token_template *tpl;
+    int rv = token_template_get(r, &tpl);
+    if(rv != OK){
+        return rv;
+    }
+
+    apr_status_t status = token_sign(r->pool, tpl, username, auth_time, prefix, suffix, out, out_len);
+    if(status != APR_SUCCESS){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01810)
+                      "Cannot sign token of %s", username);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return OK;
+}
+
+/*
+Signs a token for username out of its template. Only allocates from p, so that
+tokens can be signed by several threads at once.
+*/
+static apr_status_t token_sign(apr_pool_t *p, const token_template *tpl, const char *username, apr_time_t auth_time,
+                               const char *prefix, const char *suffix, char **out, apr_size_t *out_len){
+    const char* jti = generate_jti(p);
+    if(!jti){
+        return APR_EGENERAL;
+    }
+
+    time_t now = time(NULL);
+    char exp_str[32] = "";
+    char nbf_str[32] = "";
+    if(tpl->exp_delay >= 0){
+        apr_snprintf(exp_str, sizeof(exp_str), ",\"exp\":\"%ld\"", (long)(now + tpl->exp_delay));
+    }
+    if(tpl->nbf_delay >= 0){
+        apr_snprintf(nbf_str, sizeof(nbf_str), ",\"nbf\":\"%ld\"", (long)(now + tpl->nbf_delay));
+    }
+
+    /* same claims, as strings, as libjwt used to deliver */
+    const char *payload = apr_psprintf(p, "{%s\"iat\":\"%ld\",\"auth_time\":\"%ld\"%s%s,\"user\":\"%s\",\"jti\":\"%s\"}",
+                                       tpl->claims, (long)now, auth_time > 0 ? (long)auth_time : (long)now, exp_str, nbf_str,
+                                       json_escape(p, username), jti);
+    apr_size_t payload_len = strlen(payload);
+
+    unsigned char signature[EVP_MAX_MD_SIZE];
+    unsigned int signature_len;
+    apr_size_t prefix_len = strlen(prefix);
+    apr_size_t suffix_len = strlen(suffix);
+    char *buffer = apr_palloc(p, prefix_len + tpl->header_len + (payload_len + 2) / 3 * 4
+                                       + 1 + (EVP_MAX_MD_SIZE + 2) / 3 * 4 + suffix_len + 1);
+    char *token = buffer + prefix_len;
+    apr_size_t len;
+
+    memcpy(buffer, prefix, prefix_len);
+    memcpy(token, tpl->header, tpl->header_len);
+    len = tpl->header_len;
+    len += base64url_encode(token + len, (const unsigned char *)payload, payload_len);
+
+    if(!HMAC(tpl->md, tpl->key, tpl->key_len, (const unsigned char *)token, len, signature, &signature_len)){
+        return APR_EGENERAL;
+    }
+    token[len++] = '.';
+    len += base64url_encode(token + len, signature, signature_len);
+    memcpy(token + len, suffix, suffix_len);
+    len += prefix_len + suffix_len;
+    buffer[len] = 0;
+
+    *out = buffer;
+    *out_len = len;
+    return APR_SUCCESS;
+}
+
+/* Finds, or builds, the template of the tokens delivered for r */
+static int token_template_get(request_rec *r, const token_template **tpl){
+    token_template_key key;
+    token_template *found = NULL;
+    int rv = OK;
+
+    key.dconf = ap_get_module_config(r->per_dir_config, &auth_jwt_module);
+    key.sconf = ap_get_module_config(r->server->module_config, &auth_jwt_module);
+
+    if(!token_templates.templates){
+        token_template *built = apr_pcalloc(r->pool, sizeof(token_template));
+        rv = token_template_build(r, r->pool, built);
+        *tpl = built;
+        return rv;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(token_templates.mutex);
+#endif
+    found = apr_hash_get(token_templates.templates, &key, sizeof(key));
+    if(!found){
+        found = apr_pcalloc(token_templates.pool, sizeof(token_template));
+        rv = token_template_build(r, token_templates.pool, found);
+        if(rv == OK){
+            apr_hash_set(token_templates.templates,
+                         apr_pmemdup(token_templates.pool, &key, sizeof(key)), sizeof(key), found);
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(token_templates.mutex);
+#endif
+
+    *tpl = found;
+    return rv;
+}
+
+static int token_template_build(request_rec *r, apr_pool_t *p, token_template *tpl){
+    char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
+    char* signature_algorithm = (char *)get_config_value(r, dir_signature_algorithm);
+    char* iss = (char *)get_config_value(r, dir_iss);
+    char* aud = (char *)get_config_value(r, dir_aud);
+    char* sub = (char *)get_config_value(r, dir_sub);
+    int* exp_delay_ptr = (int*)get_config_value(r, dir_exp_delay);
+    int* nbf_delay_ptr = (int*)get_config_value(r, dir_nbf_delay);
+
+    if(!signature_secret){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "You must specify AuthJWTSignatureSecret directive in configuration");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(!signature_algorithm){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+            "Cannot retrieve specified signature algorithm. This error should not happen since a default algorithm is set.");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(check_key_length(r, signature_secret, signature_algorithm)!=OK){
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(!strcmp(signature_algorithm, "HS512")){
+        tpl->md = EVP_sha512();
+    }else if(!strcmp(signature_algorithm, "HS384")){
+        tpl->md = EVP_sha384();
+    }else if(!strcmp(signature_algorithm, "HS256")){
+        tpl->md = EVP_sha256();
+    }else{
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    /* the key length tokens are checked with */
+    tpl->key = (const unsigned char *)apr_pstrdup(p, signature_secret);
+    tpl->key_len = (int)strlen(signature_secret);
+
+    const char *header = apr_psprintf(p, "{\"alg\":\"%s\",\"typ\":\"JWT\"}", signature_algorithm);
+    char *encoded = apr_palloc(p, (strlen(header) + 2) / 3 * 4 + 2);
+    apr_size_t len = base64url_encode(encoded, (const unsigned char *)header, strlen(header));
+    encoded[len++] = '.';
+    encoded[len] = 0;
+    tpl->header = encoded;
+    tpl->header_len = len;
+
+    tpl->claims = apr_pstrcat(p,
+                              iss ? apr_psprintf(p, "\"iss\":\"%s\",", json_escape(p, iss)) : "",
+                              sub ? apr_psprintf(p, "\"sub\":\"%s\",", json_escape(p, sub)) : "",
+                              aud ? apr_psprintf(p, "\"aud\":\"%s\",", json_escape(p, aud)) : "",
+                              NULL);
+    tpl->exp_delay = exp_delay_ptr && *exp_delay_ptr >= 0 ? *exp_delay_ptr : -1;
+    tpl->nbf_delay = nbf_delay_ptr && *nbf_delay_ptr >= 0 ? *nbf_delay_ptr : -1;
+    return OK;
+}
+
+/* Escapes str to be put between the quotes of a JSON string */
+static const char *json_escape(apr_pool_t *p, const char *str){
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *in;
+    apr_size_t len = 0;
+    char *escaped, *out;
+
+    for(in = (const unsigned char *)str; *in; in++){
+        len += (*in == '"' || *in == '\\') ? 2 : (*in < 0x20 ? 6 : 1);
+    }
+    if(len == (apr_size_t)(in - (const unsigned char *)str)){
+        return str;
+    }
+
+    out = escaped = apr_palloc(p, len + 1);
+    for(in = (const unsigned char *)str; *in; in++){
+        if(*in == '"' || *in == '\\'){
+            *out++ = '\\';
+            *out++ = *in;
+        }else if(*in < 0x20){
+            *out++ = '\\';
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex[*in >> 4];
+            *out++ = hex[*in & 0x0f];
+        }else{
+            *out++ = *in;
+        }
+    }
+    *out = 0;
+    return escaped;
+}
+
+/* Base64url without padding, as JWT segments are; returns the encoded length */
+static apr_size_t base64url_encode(char *dst, const unsigned char *src, apr_size_t len){
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    char *out = dst;
+    apr_size_t i;
+
+    for(i = 0; i + 2 < len; i += 3){
+        *out++ = alphabet[src[i] >> 2];
+        *out++ = alphabet[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        *out++ = alphabet[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+        *out++ = alphabet[src[i + 2] & 0x3f];
+    }
+    if(i < len){
+        *out++ = alphabet[src[i] >> 2];
+        if(i + 1 < len){
+            *out++ = alphabet[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+            *out++ = alphabet[(src[i + 1] & 0x0f) << 2];
+        }else{
+            *out++ = alphabet[(src[i] & 0x03) << 4];
+        }
+    }
+    return out - dst;
+}
+
+static int check_authn(request_rec *r, const char *username, const char *password){
+    authn_status authn_result;
+    auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config,
+                                                      &auth_jwt_module);
+    unsigned char login_digest[APR_SHA1_DIGESTSIZE];
+
+    if(login_cache.size && username && password){
+        login_cache_digest(r, username, password, login_digest);
+        if(login_cache_lookup(r, username, login_digest) == OK){
+            return OK;
+        }
+    }
+
+    int limited = login_limiter_acquire(r);
+    if(limited != OK){
+        return limited;
+    }
+
+#if APR_HAS_THREADS
+    if(conf->providers_parallel == 1 && provider_pool && username && password
+       && conf->providers && conf->providers->next){
+        /* the login slot is given back once the last provider has answered */
+        authn_result = check_providers_parallel(r, username, password);
+    }else{
+        authn_result = check_providers(r, username, password);
+        login_limiter_release();
+    }
+#else
+    authn_result = check_providers(r, username, password);
+    login_limiter_release();
+#endif
+
+    if (authn_result != AUTH_GRANTED) {
+        int return_code;
+
+        /*if (authn_result != AUTH_DENIED) && !(conf->authoritative))
+            return DECLINED;
+        }*/
+
+        switch (authn_result) {
+          case AUTH_DENIED:
+              ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01807)
+                            "user '%s': authentication failure for \"%s\": "
+                            "password Mismatch",
+                            username, r->uri);
+              return_code = HTTP_UNAUTHORIZED;
+              break;
+          case AUTH_USER_NOT_FOUND:
+              ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01808)
+                            "user '%s' not found: %s", username, r->uri);
+              return_code = HTTP_UNAUTHORIZED;
+              break;
+          case AUTH_GENERAL_ERROR:
+          default:
+              return_code = HTTP_INTERNAL_SERVER_ERROR;
+              break;
+        }
+
+        return return_code;
+    }
+
+    if(login_cache.size){
+        login_cache_store(r, username, login_digest);
+    }
+    return OK;
+}
+
+/* Queries the providers in turn until one of them knows the user */
+static authn_status check_providers(request_rec *r, const char *username, const char *password){
+    authn_status authn_result;
+    authn_provider_list *current_provider;
+    auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config,
+                                                      &auth_jwt_module);
+
+    current_provider = conf->providers;
+    do {
+        const authn_provider *provider;
+
+        if (!current_provider) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01806)
+                          "no authn provider configured");
+            authn_result = AUTH_GENERAL_ERROR;
+            break;
+        }
+        else {
+            provider = current_provider->provider;
+            apr_table_setn(r->notes, AUTHN_PROVIDER_NAME_NOTE, current_provider->provider_name);
+        }
+
+        if (!username || !password) {
+            authn_result = AUTH_USER_NOT_FOUND;
+            break;
+        }
+
+        authn_result = provider->check_password(r, username, password);
+
+        apr_table_unset(r->notes, AUTHN_PROVIDER_NAME_NOTE);
+
+        if (authn_result != AUTH_USER_NOT_FOUND) {
+            break;
+        }
+
+        if (!conf->providers) {
+            break;
+        }
+
+        current_provider = current_provider->next;
+    } while (current_provider);
+
+    return authn_result;
+}
+
+#if APR_HAS_THREADS
+/*
+Queries all the providers at once. The result is the one the sequential walk
+would have given: the answer of the first provider, in configuration order,
+which knows the user, once all the providers before it have answered.
+*/
+static authn_status check_providers_parallel(request_rec *r, const char *username, const char *password){
+    auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config,
+                                                      &auth_jwt_module);
+    authn_provider_list *current_provider;
+    provider_fanout *fanout;
+    apr_pool_t *pool;
+    authn_status authn_result = AUTH_USER_NOT_FOUND;
+    int i, count = 0, decided = 0;
+
+    for(current_provider = conf->providers; current_provider; current_provider = current_provider->next){
+        count++;
+    }
+
+    if(apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS){
+        authn_result = check_providers(r, username, password);
+        login_limiter_release();
+        return authn_result;
+    }
+    fanout = apr_pcalloc(pool, sizeof(provider_fanout));
+    fanout->pool = pool;
+    fanout->refs = 1;
+    fanout->count = count;
+    fanout->done = apr_pcalloc(pool, count * sizeof(int));
+    fanout->results = apr_pcalloc(pool, count * sizeof(authn_status));
+    if(apr_thread_mutex_create(&fanout->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS
+       || apr_thread_cond_create(&fanout->cond, pool) != APR_SUCCESS){
+        apr_pool_destroy(pool);
+        authn_result = check_providers(r, username, password);
+        login_limiter_release();
+        return authn_result;
+    }
+    apr_pool_pre_cleanup_register(r->pool, fanout, provider_fanout_cleanup);
+
+    for(i = 0, current_provider = conf->providers; current_provider; i++, current_provider = current_provider->next){
+        provider_query *query;
+        apr_status_t rv = APR_ENOMEM;
+
+        if(apr_pool_create_unmanaged_ex(&pool, NULL, NULL) == APR_SUCCESS){
+            query = apr_pcalloc(pool, sizeof(provider_query));
+            query->fanout = fanout;
+            query->index = i;
+            query->provider = current_provider->provider;
+            query->r = provider_query_request(pool, r);
+            query->username = apr_pstrdup(pool, username);
+            query->password = apr_pstrdup(pool, password);
+            apr_table_setn(query->r->notes, AUTHN_PROVIDER_NAME_NOTE,
+                           apr_pstrdup(pool, current_provider->provider_name));
+
+            apr_thread_mutex_lock(fanout->mutex);
+            fanout->refs++;
+            apr_thread_mutex_unlock(fanout->mutex);
+
+            rv = apr_thread_pool_push(provider_pool, provider_query_run, query, APR_THREAD_TASK_PRIORITY_NORMAL, NULL);
+            if(rv != APR_SUCCESS){
+                apr_pool_destroy(pool);
+                apr_thread_mutex_lock(fanout->mutex);
+                fanout->refs--;
+                apr_thread_mutex_unlock(fanout->mutex);
+            }
+        }
+        if(rv != APR_SUCCESS){
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01810)
+                          "Cannot query provider %s", current_provider->provider_name);
+            apr_thread_mutex_lock(fanout->mutex);
+            fanout->results[i] = AUTH_GENERAL_ERROR;
+            fanout->done[i] = 1;
+            apr_thread_mutex_unlock(fanout->mutex);
+        }
+    }
+
+    apr_thread_mutex_lock(fanout->mutex);
+    while(!decided){
+        for(i = 0; i < count && fanout->done[i]; i++){
+            if(fanout->results[i] != AUTH_USER_NOT_FOUND){
+                break;
+            }
+        }
+        if(i == count){
+            authn_result = AUTH_USER_NOT_FOUND;
+            decided = 1;
+        }else if(fanout->done[i]){
+            authn_result = fanout->results[i];
+            decided = 1;
+        }else{
+            apr_thread_cond_wait(fanout->cond, fanout->mutex);
+        }
+    }
+    apr_thread_mutex_unlock(fanout->mutex);
+
+    /* the reference of the request is released by provider_fanout_cleanup */
+    return authn_result;
+}
+
+/*
+A copy of the request a provider can use from another thread while the request
+goes on. Tables and the per directory configuration vector a provider may read
+are copied, configuration vectors it may write to are fresh ones.
+*/
+static request_rec *provider_query_request(apr_pool_t *p, request_rec *r){
+    request_rec *rr = apr_pmemdup(p, r, sizeof(request_rec));
+    conn_rec *c = apr_pmemdup(p, r->connection, sizeof(conn_rec));
+    module *m;
+
+    c->pool = p;
+    c->conn_config = ap_create_conn_config(p);
+    rr->connection = c;
+    rr->pool = p;
+    rr->main = NULL;
+    rr->prev = NULL;
+    rr->next = NULL;
+    rr->request_config = ap_create_request_config(p);
+    rr->per_dir_config = ap_create_per_dir_config(p);
+    for(m = ap_top_module; m; m = m->next){
+        ap_set_module_config(rr->per_dir_config, m, ap_get_module_config(r->per_dir_config, m));
+    }
+    rr->headers_in = apr_table_copy(p, r->headers_in);
+    rr->headers_out = apr_table_make(p, 1);
+    rr->err_headers_out = apr_table_make(p, 1);
+    rr->subprocess_env = apr_table_copy(p, r->subprocess_env);
+    rr->notes = apr_table_copy(p, r->notes);
+    rr->user = apr_pstrdup(p, r->user);
+    return rr;
+}
+
+static void provider_fanout_release(provider_fanout *fanout){
+    int refs;
+    apr_thread_mutex_lock(fanout->mutex);
+    refs = --fanout->refs;
+    apr_thread_mutex_unlock(fanout->mutex);
+    if(refs == 0){
+        apr_pool_destroy(fanout->pool);
+        login_limiter_release();
+    }
+}
+
+/* Keeps the request pool until the last query is over, then drops its reference */
+static apr_status_t provider_fanout_cleanup(void *data){
+    provider_fanout *fanout = (provider_fanout *)data;
+    int i;
+
+    apr_thread_mutex_lock(fanout->mutex);
+    for(i = 0; i < fanout->count; i++){
+        while(!fanout->done[i]){
+            apr_thread_cond_wait(fanout->cond, fanout->mutex);
+        }
+    }
+    apr_thread_mutex_unlock(fanout->mutex);
+
+    provider_fanout_release(fanout);
+    return APR_SUCCESS;
+}
+
+static void *APR_THREAD_FUNC provider_query_run(apr_thread_t *thread, void *data){
+    provider_query *query = (provider_query *)data;
+    provider_fanout *fanout = query->fanout;
+    authn_status result;
+
+    result = query->provider->check_password(query->r, query->username, query->password);
+
+    apr_thread_mutex_lock(fanout->mutex);
+    fanout->results[query->index] = result;
+    fanout->done[query->index] = 1;
+    apr_thread_cond_signal(fanout->cond);
+    apr_thread_mutex_unlock(fanout->mutex);
+
+    apr_pool_destroy(query->r->pool);
+    provider_fanout_release(fanout);
+    return NULL;
+}
+#endif
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  LOGIN LIMITER ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+/* The counters are reset at each restart, there is one holder per possible child */
+static apr_status_t login_limiter_init(apr_pool_t *pconf, auth_jwt_config_rec *sconf){
+    int daemons = 0;
+    apr_status_t rv;
+
+    if(ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons) != APR_SUCCESS || daemons <= 0){
+        daemons = 1;
+    }
+    rv = apr_shm_create(&login_limiter.shm, APR_ALIGN_DEFAULT(sizeof(login_limiter_counters))
+                        + (apr_size_t)daemons * sizeof(login_limiter_holder), NULL, pconf);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    login_limiter.counters = (login_limiter_counters *)apr_shm_baseaddr_get(login_limiter.shm);
+    memset(login_limiter.counters, 0, apr_shm_size_get(login_limiter.shm));
+    login_limiter.holders = (login_limiter_holder *)((char *)login_limiter.counters
+                            + APR_ALIGN_DEFAULT(sizeof(login_limiter_counters)));
+    login_limiter.holders_count = (apr_uint32_t)daemons;
+    login_limiter.max = (apr_uint32_t)sconf->login_concurrency;
+    login_limiter.queue = (apr_uint32_t)sconf->login_queue;
+    login_limiter.wait = apr_time_from_msec(sconf->login_wait);
+    return APR_SUCCESS;
+}
+
+/*
+Gives back the slots held by dead children, then takes a free holder record.
+Shared counters are always incremented before and decremented after the holder
+ones, so that a child dying in between can only leak a slot, never free twice.
+*/
+static void login_limiter_child_init(apr_pool_t *p, server_rec *s){
+    apr_uint32_t pid = (apr_uint32_t)getpid();
+    apr_uint32_t i, reclaimed = 0;
+
+    login_limiter.self = NULL;
+    if(!login_limiter.holders){
+        return;
+    }
+    for(i=0;i<login_limiter.holders_count;i++){
+        login_limiter_holder *holder = &login_limiter.holders[i];
+        apr_uint32_t owner = apr_atomic_read32(&holder->pid);
+        apr_uint32_t active, waiting;
+
+        if(!owner || owner == LOGIN_LIMITER_RECLAIMING || kill((pid_t)owner, 0) == 0 || errno != ESRCH
+           || apr_atomic_cas32(&holder->pid, LOGIN_LIMITER_RECLAIMING, owner) != owner){
+            continue;
+        }
+        active = apr_atomic_read32(&holder->active);
+        waiting = apr_atomic_read32(&holder->waiting);
+        apr_atomic_sub32(&login_limiter.counters->active, active);
+        apr_atomic_sub32(&login_limiter.counters->waiting, waiting);
+        apr_atomic_set32(&holder->active, 0);
+        apr_atomic_set32(&holder->waiting, 0);
+        apr_atomic_set32(&holder->pid, 0);
+        reclaimed += active;
+    }
+    if(reclaimed){
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(01810)
+                     "%u login slots held by dead children reclaimed", reclaimed);
+    }
+    for(i=0;i<login_limiter.holders_count && !login_limiter.self;i++){
+        if(apr_atomic_cas32(&login_limiter.holders[i].pid, pid, 0) == 0){
+            login_limiter.self = &login_limiter.holders[i];
+        }
+    }
+}
+
+static int login_limiter_try(void){
+    apr_uint32_t active = apr_atomic_read32(&login_limiter.counters->active);
+    while(active < login_limiter.max){
+        apr_uint32_t previous = apr_atomic_cas32(&login_limiter.counters->active, active + 1, active);
+        if(previous == active){
+            if(login_limiter.self){
+                apr_atomic_inc32(&login_limiter.self->active);
+            }
+            return 1;
+        }
+        active = previous;
+    }
+    return 0;
+}
+
+static int login_limiter_acquire(request_rec *r){
+    apr_time_t deadline;
+    apr_interval_time_t pause = apr_time_from_msec(1);
+    apr_uint32_t waiting;
+    int acquired = 0;
+
+    if(!login_limiter.max || login_limiter_try()){
+        return OK;
+    }
+
+    waiting = apr_atomic_add32(&login_limiter.counters->waiting, 1);
+    if(login_limiter.self){
+        apr_atomic_inc32(&login_limiter.self->waiting);
+    }
+    if(waiting < login_limiter.queue){
+        deadline = apr_time_now() + login_limiter.wait;
+        while(!acquired && apr_time_now() < deadline){
+            apr_sleep(pause);
+            if(pause < apr_time_from_msec(20)){
+                pause *= 2;
+            }
+            acquired = login_limiter_try();
+        }
+    }
+    if(login_limiter.self){
+        apr_atomic_dec32(&login_limiter.self->waiting);
+    }
+    apr_atomic_dec32(&login_limiter.counters->waiting);
+
+    if(acquired){
+        return OK;
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(01810)
+                  "Too many concurrent logins, login of %s rejected", r->user);
+    apr_table_setn(r->err_headers_out, "Retry-After", LOGIN_RETRY_AFTER);
+    return HTTP_SERVICE_UNAVAILABLE;
+}
+
+static void login_limiter_release(void){
+    if(login_limiter.max){
+        if(login_limiter.self){
+            apr_atomic_dec32(&login_limiter.self->active);
+        }
+        apr_atomic_dec32(&login_limiter.counters->active);
+    }
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  LOGIN THROTTLING ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static apr_status_t throttle_init(apr_pool_t *pconf, auth_jwt_config_rec *sconf){
+    apr_uint32_t buckets = ((apr_uint32_t)sconf->throttle_table_size + THROTTLE_BUCKET_SIZE - 1) / THROTTLE_BUCKET_SIZE;
+    apr_size_t size = THROTTLE_STRIPES * sizeof(throttle_stripe)
+                    + (apr_size_t)buckets * THROTTLE_BUCKET_SIZE * sizeof(throttle_entry);
+    apr_status_t rv;
+
+    rv = apr_shm_create(&throttle_table.shm, size, NULL, pconf);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    throttle_table.stripes = (throttle_stripe *)apr_shm_baseaddr_get(throttle_table.shm);
+    memset(throttle_table.stripes, 0, size);
+    throttle_table.entries = (throttle_entry *)(throttle_table.stripes + THROTTLE_STRIPES);
+    throttle_table.buckets = buckets;
+    return APR_SUCCESS;
+}
+
+/* Takes a token from the bucket of prefix:value, or tells when one will be available */
+static int throttle_take(const char *prefix, const char *value, int rate, int burst, apr_time_t now, apr_interval_time_t *retry){
+    apr_uint64_t key;
+    apr_uint32_t index;
+    throttle_stripe *stripe;
+    throttle_entry *bucket, *entry = NULL;
+    apr_uint64_t tokens, capacity = (apr_uint64_t)burst * 1000;
+    apr_interval_time_t fill = (apr_interval_time_t)(capacity * apr_time_from_sec(60) / ((apr_uint64_t)rate * 1000)) + 1;
+    int i, spins, allowed;
+
+    apr_sha1_ctx_t context;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    apr_sha1_init(&context);
+    apr_sha1_update(&context, prefix, strlen(prefix) + 1);
+    apr_sha1_update(&context, value, strlen(value));
+    apr_sha1_final(digest, &context);
+    key = ((apr_uint64_t)digest_hash(digest) << 32) | digest_hash(digest + 4);
+    key = key ? key : 1;
+
+    index = (apr_uint32_t)(key % throttle_table.buckets);
+    bucket = &throttle_table.entries[index * THROTTLE_BUCKET_SIZE];
+    stripe = &throttle_table.stripes[index % THROTTLE_STRIPES];
+
+    for(spins = 1; apr_atomic_cas32(&stripe->lock, 1, 0) != 0; spins++){
+        if(spins % THROTTLE_SPINS == 0){
+#if APR_HAS_THREADS
+            apr_thread_yield();
+#else
+            apr_sleep(0);
+#endif
+        }
+    }
+
+    for(i=0;i<THROTTLE_BUCKET_SIZE;i++){
+        if(bucket[i].key == key){
+            entry = &bucket[i];
+            break;
+        }
+        if(!entry || bucket[i].last < entry->last){
+            entry = &bucket[i];
+        }
+    }
+    if(entry->key != key){
+        entry->key = key;
+        entry->last = now;
+        entry->tokens = (apr_uint32_t)capacity;
+    }
+
+    tokens = entry->tokens;
+    if(now - entry->last >= fill){
+        tokens = capacity;
+        entry->last = now;
+    }else if(now > entry->last){
+        /* only the time converted into tokens is consumed */
+        apr_uint64_t gained = (apr_uint64_t)(now - entry->last) * rate * 1000 / apr_time_from_sec(60);
+        entry->last += (apr_interval_time_t)(gained * apr_time_from_sec(60) / ((apr_uint64_t)rate * 1000));
+        tokens += gained;
+        if(tokens >= capacity){
+            tokens = capacity;
+            entry->last = now;
+        }
+    }
+
+    allowed = tokens >= 1000;
+    if(allowed){
+        tokens -= 1000;
+    }else{
+        *retry = (apr_interval_time_t)((1000 - tokens) * apr_time_from_sec(60) / ((apr_uint64_t)rate * 1000)) + 1;
+    }
+    entry->tokens = (apr_uint32_t)tokens;
+
+    apr_atomic_set32(&stripe->lock, 0);
+    return allowed;
+}
+
+static int throttle_check(request_rec *r, const char *prefix, const char *value, int rate, int burst){
+    apr_interval_time_t retry;
+
+    if(!throttle_table.buckets || rate <= 0 || !value){
+        return OK;
+    }
+    if(throttle_take(prefix, value, rate, burst > 0 ? burst : 1, apr_time_now(), &retry)){
+        return OK;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(01810)
+                  "Too many logins for %s %s", prefix, value);
+    apr_table_setn(r->err_headers_out, "Retry-After",
+                   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_sec(retry) + 1));
+    return HTTP_TOO_MANY_REQUESTS;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  LOGIN CACHE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static apr_status_t login_cache_init(apr_pool_t *pconf, auth_jwt_config_rec *sconf){
+    apr_size_t size = (apr_size_t)sconf->login_cache_size * sizeof(login_cache_entry);
+    apr_status_t rv;
+
+    rv = apr_generate_random_bytes(login_cache.salt, LOGIN_CACHE_SALT_SIZE);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    rv = apr_shm_create(&login_cache.shm, size, NULL, pconf);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    login_cache.entries = (login_cache_entry *)apr_shm_baseaddr_get(login_cache.shm);
+    memset(login_cache.entries, 0, size);
+    login_cache.size = (apr_uint32_t)sconf->login_cache_size;
+    login_cache.ttl = apr_time_from_sec(sconf->login_cache_ttl);
+    return APR_SUCCESS;
+}
+
+/*
+Identifies the section which configures the request: the virtual host where it
+is defined and the directory or location path. Two sections may use the same
+providers with different backing stores, e.g. two AuthUserFile.
+*/
+static void location_identity_update(request_rec *r, apr_sha1_ctx_t *context){
+    auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config, &auth_jwt_module);
+    const char *identity = apr_psprintf(r->pool, "%s:%u:%s", r->server->defn_name ? r->server->defn_name : "",
+                                        r->server->defn_line_number, conf->dir ? conf->dir : "");
+
+    apr_sha1_update(context, identity, strlen(identity) + 1);
+}
+
+static void login_cache_digest(request_rec *r, const char *username, const char *password, unsigned char *digest){
+    auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config, &auth_jwt_module);
+    authn_provider_list *current_provider;
+    apr_sha1_ctx_t context;
+
+    apr_sha1_init(&context);
+    apr_sha1_update_binary(&context, login_cache.salt, LOGIN_CACHE_SALT_SIZE);
+    location_identity_update(r, &context);
+    for(current_provider = conf->providers; current_provider; current_provider = current_provider->next){
+        apr_sha1_update(&context, current_provider->provider_name, strlen(current_provider->provider_name) + 1);
+    }
+    apr_sha1_update(&context, username, strlen(username) + 1);
+    apr_sha1_update(&context, password, strlen(password));
+    apr_sha1_final(digest, &context);
+}
+
+static int login_cache_lookup(request_rec *r, const char *username, const unsigned char *digest){
+    login_cache_entry *entry = &login_cache.entries[digest_hash(digest) % login_cache.size];
+    login_cache_entry copy;
+    apr_uint32_t seq = apr_atomic_read32(&entry->seq);
+
+    if(seq & 1){
+        return DECLINED;
+    }
+    memcpy(&copy, (const void *)entry, sizeof(copy));
+    if(apr_atomic_cas32(&entry->seq, seq, seq) != seq){
+        return DECLINED;
+    }
+
+    if(memcmp(copy.digest, digest, APR_SHA1_DIGESTSIZE) || copy.until < r->request_time
+        || copy.user != claim_hash(username)){
+        return DECLINED;
+    }
+    if(user_invalidated(r, username, apr_time_sec(copy.created))){
+        return DECLINED;
+    }
+    return OK;
+}
+
+static void login_cache_store(request_rec *r, const char *username, const unsigned char *digest){
+    login_cache_entry *entry = &login_cache.entries[digest_hash(digest) % login_cache.size];
+    apr_uint32_t seq = apr_atomic_read32(&entry->seq);
+
+    if((seq & 1) || apr_atomic_cas32(&entry->seq, seq + 1, seq) != seq){
+        return;
+    }
+    memcpy(entry->digest, digest, APR_SHA1_DIGESTSIZE);
+    entry->user = claim_hash(username);
+    entry->created = r->request_time;
+    entry->until = r->request_time + login_cache.ttl;
+    apr_atomic_inc32(&entry->seq);
+}
+
+
+/*
+If we are configured to handle authentication, let's look up headers to find
+whether or not 'Authorization' is set. If so, exepected format is
+Authorization: Bearer json_web_token. Then we check if the token is valid.
+*/
+static int auth_jwt_authn_with_token(request_rec *r){
+    const char *current_auth = NULL;
+    current_auth = ap_auth_type(r);
+    int rv;
+
+    if (!current_auth || strcmp(current_auth, "jwt")) {
+        return DECLINED;
+    }
+
+    /* We need an authentication realm. */
+    if (!ap_auth_name(r)) {
+       ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                     "need AuthName: %s", r->uri);
+       return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!ap_auth_name(r)) {
+         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                       "need AuthName: %s", r->uri);
+         return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->ap_auth_type = (char *) current_auth;
+
+    char* authorization_header = (char*)apr_table_get( r->headers_in, "Authorization");
+    char* token_str;
+
+    char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
+    if(signature_secret == NULL){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                    "You must specify AuthJWTSignatureSecret directive in configuration");
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(!authorization_header){
+        apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool, "Bearer realm=\"", ap_auth_name(r),"\"", NULL));
+        return HTTP_UNAUTHORIZED;
+    }
+
+    const auth_jwt_request_rec *verified = find_verified_request(r, authorization_header);
+    if(verified){
+        r->user = (char *)verified->user;
+        ap_set_module_config(r->request_config, &auth_jwt_module, (void *)verified);
+        return OK;
+    }
+
+    int header_len = strlen(authorization_header);
+    if(header_len > 7 && !strncmp(authorization_header, "Bearer ", 7)){
+        token_str = authorization_header+7;
+
+        unsigned char digest[TOKEN_DIGEST_SIZE];
+        verified_token cached;
+        token_digest(r, token_str, digest);
+        if(conn_cache_lookup(r, digest, &cached) == OK){
+            r->user = apr_pstrdup(r->pool, cached.user);
+            set_verified_request(r, authorization_header, r->user, NULL);
+            token_renew(r, digest, &cached);
+            return OK;
+        }
+
+        token_flight* flight = NULL;
+        if(token_cache_acquire(r, digest, &cached, &flight) == OK){
+            r->user = apr_pstrdup(r->pool, cached.user);
+            set_verified_request(r, authorization_header, r->user, NULL);
+            conn_cache_store(r, digest, &cached);
+            token_renew(r, digest, &cached);
+            return OK;
+        }
+
+        if(remote_cache_lookup(r, digest, &cached) == OK){
+            r->user = apr_pstrdup(r->pool, cached.user);
+            set_verified_request(r, authorization_header, r->user, NULL);
+            conn_cache_store(r, digest, &cached);
+            token_cache_release(digest, flight, &cached);
+            token_renew(r, digest, &cached);
+            return OK;
+        }
+
+        jwt_t* token = NULL;
+        rv = token_check(r, &token, token_str, signature_secret);
+        if(token){
+            apr_pool_cleanup_register(r->pool, token, token_cleanup, apr_pool_cleanup_null);
+        }
+        if(OK == rv){
+            char* maybe_user = (char *)token_get_claim(token, "user");
+            if(maybe_user == NULL){
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                  "Username was not in token");
+                apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool,
+                  "Bearer realm=\"", ap_auth_name(r),"\", error=\"invalid_token\", error_description=\"Username was not in token\"",
+                   NULL));
+                token_cache_release(digest, flight, NULL);
+                return HTTP_UNAUTHORIZED;
+            }
+            r->user = maybe_user;
+            set_verified_request(r, authorization_header, maybe_user, token);
+            if(verified_token_from_jwt(token, maybe_user, &cached) == OK){
+                conn_cache_store(r, digest, &cached);
+                token_cache_release(digest, flight, &cached);
+                remote_cache_store(r, digest, &cached);
+                token_renew(r, digest, &cached);
+            }else{
+                token_cache_release(digest, flight, NULL);
+            }
+            return OK;
+        }else{
+            token_cache_release(digest, flight, NULL);
+            return rv;
+        }
+    }else{
+        apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool,
+          "Bearer realm=\"", ap_auth_name(r),"\", error=\"invalid_request\", error_description=\"Authentication type must be Bearer\"",
+           NULL));
+        return HTTP_BAD_REQUEST;
+    }
+}
+
+/*
+Subrequests (mod_include, mod_rewrite, mod_negotiation...) and ErrorDocument
+internal redirects run check_authn again. If the main or previous request has
+already verified the same Authorization header with the same parameters, its
+result is reused.
+*/
+static const auth_jwt_request_rec *find_verified_request(request_rec *r, const char *authorization){
+    request_rec *parent = r->main ? r->main : r->prev;
+    if(!parent){
+        return NULL;
+    }
+
+    const char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
+    const char* iss = (char *)get_config_value(r, dir_iss);
+    const char* aud = (char *)get_config_value(r, dir_aud);
+    const char* sub = (char *)get_config_value(r, dir_sub);
+
+    for(; parent; parent = parent->main ? parent->main : parent->prev){
+        const auth_jwt_request_rec *rconf = (auth_jwt_request_rec *) ap_get_module_config(parent->request_config,
+                                                    &auth_jwt_module);
+        if(!rconf || strcmp(rconf->authorization, authorization)){
+            continue;
+        }
+        if(same_param(rconf->signature_secret, signature_secret) && same_param(rconf->iss, iss)
+            && same_param(rconf->aud, aud) && same_param(rconf->sub, sub)){
+            return rconf;
+        }
+    }
+    return NULL;
+}
+
+static void set_verified_request(request_rec *r, const char *authorization, const char *user, jwt_t *token){
+    auth_jwt_request_rec *rconf = apr_pcalloc(r->pool, sizeof(*rconf));
+    rconf->authorization = authorization;
+    rconf->signature_secret = (char*)get_config_value(r, dir_signature_secret);
+    rconf->iss = (char *)get_config_value(r, dir_iss);
+    rconf->aud = (char *)get_config_value(r, dir_aud);
+    rconf->sub = (char *)get_config_value(r, dir_sub);
+    rconf->user = user;
+    rconf->token = token;
+    ap_set_module_config(r->request_config, &auth_jwt_module, rconf);
+}
+
+static int same_param(const char *a, const char *b){
+    if(a == b){
+        return 1;
+    }
+    return a && b && !strcmp(a, b);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  CONNECTION CACHE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static int auth_jwt_pre_connection(conn_rec *c, void *csd){
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+    /* HTTP/2 secondary connections use the record of their master */
+    if(c->master){
+        return OK;
+    }
+#endif
+    auth_jwt_conn_rec *cconf = apr_pcalloc(c->pool, sizeof(*cconf));
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&cconf->mutex, APR_THREAD_MUTEX_DEFAULT, c->pool) != APR_SUCCESS){
+        return OK;
+    }
+#endif
+    ap_set_module_config(c->conn_config, &auth_jwt_module, cconf);
+    return OK;
+}
+
+static auth_jwt_conn_rec *get_conn_cache(request_rec *r){
+    conn_rec *c = r->connection;
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+    if(c->master){
+        c = c->master;
+    }
+#endif
+    return (auth_jwt_conn_rec *) ap_get_module_config(c->conn_config, &auth_jwt_module);
+}
+
+static int conn_cache_lookup(request_rec *r, const unsigned char *digest, verified_token *vt){
+    auth_jwt_conn_rec *cconf = get_conn_cache(r);
+    int rv = DECLINED;
+    if(!cconf){
+        return DECLINED;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cconf->mutex);
+#endif
+    if(cconf->valid && !memcmp(cconf->digest, digest, TOKEN_DIGEST_SIZE)){
+        *vt = cconf->token;
+        rv = OK;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cconf->mutex);
+#endif
+    if(rv == OK && verified_token_check(r, vt) != OK){
+        /* expired or revoked: next time this token goes through the full check */
+        cconf->valid = 0;
+        rv = DECLINED;
+    }
+    return rv;
+}
+
+static void conn_cache_store(request_rec *r, const unsigned char *digest, const verified_token *vt){
+    auth_jwt_conn_rec *cconf = get_conn_cache(r);
+    if(!cconf){
+        return;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cconf->mutex);
+#endif
+    memcpy(cconf->digest, digest, TOKEN_DIGEST_SIZE);
+    cconf->token = *vt;
+    cconf->valid = 1;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cconf->mutex);
+#endif
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  SHARED TOKEN CACHE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static int auth_jwt_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp){
+    /* the key set digest is fed by the directive handlers while parsing */
+    apr_sha1_init(&key_set_context);
+    memset(&shared_cache, 0, sizeof(shared_cache));
+    memset(&remote_cache, 0, sizeof(remote_cache));
+    ap_mutex_register(pconf, SOCACHE_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, REVOCATION_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, REVOCATION_LIST_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, USER_INVALIDATION_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, REFRESH_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, ALLOWLIST_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    memset(&revocation_list, 0, sizeof(revocation_list));
+    memset(&user_invalidation, 0, sizeof(user_invalidation));
+    memset(&login_cache, 0, sizeof(login_cache));
+    memset(&login_limiter, 0, sizeof(login_limiter));
+    memset(&throttle_table, 0, sizeof(throttle_table));
+    memset(&refresh_table, 0, sizeof(refresh_table));
+    scope_bits.names = apr_hash_make(pconf);
+    scope_bits.count = 0;
+    role_bits.names = apr_hash_make(pconf);
+    role_bits.count = 0;
+    allowlists = apr_hash_make(pconf);
+    allowlist_mutex = NULL;
+#if APR_HAS_THREADS
+    providers_parallel_used = 0;
+    provider_pool = NULL;
+#endif
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+    login_pool = NULL;
+#endif
+#if APR_HAS_THREADS
+    mint_pool = NULL;
+#endif
+    return OK;
+}
+
+static int auth_jwt_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s){
+    auth_jwt_config_rec *sconf = (auth_jwt_config_rec *) ap_get_module_config(s->module_config,
+                                                    &auth_jwt_module);
+    unsigned char key_set_digest[APR_SHA1_DIGESTSIZE];
+
+    apr_sha1_final(key_set_digest, &key_set_context);
+    shared_cache.generation = digest_hash(key_set_digest);
+
+    if(sconf->cache_file){
+        apr_status_t rv = shared_cache_attach(pconf, s, sconf->cache_file, (apr_uint32_t)sconf->cache_file_entries);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot map token cache file %s", sconf->cache_file);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->socache_provider){
+        apr_status_t rv = remote_cache_init(pconf, ptemp, s, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot initialize %s token cache", sconf->socache_provider->name);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->revocation_table_size > 0){
+        apr_status_t rv = revocation_table_init(pconf, s, (apr_uint32_t)sconf->revocation_table_size);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create token revocation table");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->revocation_file){
+        apr_status_t rv = revocation_list_init(pconf, ptemp, s, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot load revocation file %s", sconf->revocation_file);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->user_invalidation_table_size > 0){
+        apr_status_t rv = user_invalidation_init(pconf, ptemp, s, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create user invalidation table");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->login_cache_ttl > 0 && sconf->login_cache_size > 0){
+        apr_status_t rv = login_cache_init(pconf, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create login cache");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->login_concurrency > 0){
+        apr_status_t rv = login_limiter_init(pconf, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create login concurrency limiter");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(apr_hash_count(allowlists) > 0){
+        apr_status_t rv = allowlist_init(pconf, ptemp, s);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot compile claim allowlists");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if(sconf->refresh_table_size > 0){
+        apr_status_t rv = refresh_table_init(pconf, s, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create refresh token table");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if((sconf->throttle_ip_rate > 0 || sconf->throttle_user_rate > 0) && sconf->throttle_table_size > 0){
+        apr_status_t rv = throttle_init(pconf, sconf);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create login throttling table");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    return OK;
+}
+
+/*
+Maps the cache file in the parent process so that every child inherits the
+mapping. An existing file is reused as is when its layout matches, stale
+generations are simply never matched by lookups.
+*/
+static apr_status_t shared_cache_attach(apr_pool_t *p, server_rec *s, const char *path, apr_uint32_t entries){
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mmap;
+    apr_size_t size = sizeof(shared_cache_header) + (apr_size_t)entries * sizeof(shared_cache_entry);
+    shared_cache_header *header;
+    apr_uint32_t i, reset = 0;
+    apr_status_t rv;
+
+    rv = apr_file_open(&file, path, APR_READ | APR_WRITE | APR_CREATE | APR_BINARY,
+                       APR_FPROT_UREAD | APR_FPROT_UWRITE, p);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if(rv == APR_SUCCESS && (apr_size_t)finfo.size != size){
+        rv = apr_file_trunc(file, 0);
+        if(rv == APR_SUCCESS){
+            rv = apr_file_trunc(file, (apr_off_t)size);
+        }
+    }
+    if(rv == APR_SUCCESS){
+        rv = apr_mmap_create(&mmap, file, 0, size, APR_MMAP_READ | APR_MMAP_WRITE, p);
+    }
+    apr_file_close(file);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    header = (shared_cache_header *)mmap->mm;
+    if(memcmp(header->magic, CACHE_FILE_MAGIC, sizeof(header->magic)) || header->version != CACHE_FILE_VERSION
+        || header->entries != entries || header->entry_size != sizeof(shared_cache_entry)){
+        memset(mmap->mm, 0, size);
+        memcpy(header->magic, CACHE_FILE_MAGIC, sizeof(header->magic));
+        header->version = CACHE_FILE_VERSION;
+        header->entries = entries;
+        header->entry_size = sizeof(shared_cache_entry);
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(01810)
+                     "Token cache file %s initialized with %u entries", path, entries);
+    }else if(header->generation != shared_cache.generation){
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(01810)
+                     "Signature keys changed, cached tokens in %s are discarded", path);
+    }
+    header->generation = shared_cache.generation;
+
+    /* entries left odd by a writer which died halfway would be skipped forever */
+    for(i = 0; i < entries; i++){
+        shared_cache_entry *entry = (shared_cache_entry *)(header + 1) + i;
+        apr_uint32_t seq = apr_atomic_read32(&entry->seq);
+        if(seq & 1){
+            entry->generation = 0;
+            memset(entry->digest, 0, TOKEN_DIGEST_SIZE);
+            apr_atomic_set32(&entry->seq, seq + 1);
+            reset++;
+        }
+    }
+    if(reset){
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(01810)
+                     "%u interrupted entries of token cache file %s reset", reset, path);
+    }
+
+    shared_cache.header = header;
+    shared_cache.entries = (shared_cache_entry *)(header + 1);
+    shared_cache.size = entries;
+    return APR_SUCCESS;
+}
+
+static int shared_cache_lookup(request_rec *r, const unsigned char *digest, verified_token *vt){
+    shared_cache_entry *entry;
+    shared_cache_entry copy;
+    apr_uint32_t seq;
+
+    if(!shared_cache.size){
+        return DECLINED;
+    }
+
+    entry = &shared_cache.entries[digest_hash(digest) % shared_cache.size];
+    seq = apr_atomic_read32(&entry->seq);
+    if(seq & 1){
+        return DECLINED;
+    }
+    memcpy(&copy, (const void *)entry, sizeof(copy));
+    /* full barrier, fails if a writer went through meanwhile */
+    if(apr_atomic_cas32(&entry->seq, seq, seq) != seq){
+        return DECLINED;
+    }
+
+    if(copy.generation != shared_cache.generation || memcmp(copy.digest, digest, TOKEN_DIGEST_SIZE)){
+        return DECLINED;
+    }
+    copy.token.user[CACHED_USER_SIZE - 1] = 0;
+    *vt = copy.token;
+    return verified_token_check(r, vt);
+}
+
+static void shared_cache_store(const unsigned char *digest, const verified_token *vt){
+    shared_cache_entry *entry;
+    apr_uint32_t seq;
+
+    if(!shared_cache.size){
+        return;
+    }
+
+    entry = &shared_cache.entries[digest_hash(digest) % shared_cache.size];
+    seq = apr_atomic_read32(&entry->seq);
+    /* the cache is best effort: give up if another writer holds the entry */
+    if((seq & 1) || apr_atomic_cas32(&entry->seq, seq + 1, seq) != seq){
+        return;
+    }
+    entry->generation = shared_cache.generation;
+    memcpy(entry->digest, digest, TOKEN_DIGEST_SIZE);
+    entry->token = *vt;
+    apr_atomic_inc32(&entry->seq);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  REMOTE TOKEN CACHE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static apr_status_t remote_cache_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, auth_jwt_config_rec *sconf){
+    struct ap_socache_hints hints = { TOKEN_DIGEST_SIZE, SOCACHE_VALUE_SIZE, apr_time_from_sec(30) };
+    const char *err;
+    apr_status_t rv;
+
+    remote_cache.provider = sconf->socache_provider;
+    remote_cache.server = s;
+
+    err = remote_cache.provider->create(&remote_cache.instance, sconf->socache_args, ptemp, pconf);
+    if(err){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "AuthJWTSocache: %s", err);
+        return APR_EGENERAL;
+    }
+
+    if(remote_cache.provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE){
+        rv = ap_global_mutex_create(&remote_cache.mutex, NULL, SOCACHE_MUTEX_TYPE, NULL, s, pconf, 0);
+        if(rv != APR_SUCCESS){
+            return rv;
+        }
+    }
+
+    rv = remote_cache.provider->init(remote_cache.instance, "authnz_jwt", &hints, s, pconf);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    apr_pool_cleanup_register(pconf, &remote_cache, remote_cache_destroy, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
+static apr_status_t remote_cache_destroy(void *data){
+    remote_cache_t *cache = (remote_cache_t *)data;
+    if(cache->instance){
+        cache->provider->destroy(cache->instance, cache->server);
+        cache->instance = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static void remote_cache_child_init(apr_pool_t *p, server_rec *s){
+    if(!remote_cache.instance){
+        return;
+    }
+
+    if(remote_cache.mutex){
+        apr_global_mutex_child_init(&remote_cache.mutex, apr_global_mutex_lockfile(remote_cache.mutex), p);
+    }
+
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&remote_cache.queue_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS
+        || apr_thread_cond_create(&remote_cache.queue_cond, p) != APR_SUCCESS
+        || apr_thread_create(&remote_cache.writer, NULL, remote_cache_writer, NULL, p) != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "Cannot start token cache writer, tokens will be stored synchronously");
+        remote_cache.writer = NULL;
+        return;
+    }
+    apr_pool_cleanup_register(p, &remote_cache, remote_cache_stop_writer, apr_pool_cleanup_null);
+#endif
+}
+
+static int remote_cache_lookup(request_rec *r, const unsigned char *digest, verified_token *vt){
+    unsigned char value[SOCACHE_VALUE_SIZE];
+    unsigned int value_len = sizeof(value) - 1;
+    const char *secret = (const char *)get_config_value(r, dir_signature_secret);
+    char mac[2 * SOCACHE_MAC_SIZE];
+    char *fields[5];
+    char *last;
+    int i;
+    apr_status_t rv;
+
+    if(!remote_cache.instance || !secret){
+        return DECLINED;
+    }
+
+    if(remote_cache.mutex){
+        apr_global_mutex_lock(remote_cache.mutex);
+    }
+    rv = remote_cache.provider->retrieve(remote_cache.instance, r->server, digest, TOKEN_DIGEST_SIZE,
+                                         value, &value_len, r->pool);
+    if(remote_cache.mutex){
+        apr_global_mutex_unlock(remote_cache.mutex);
+    }
+    if(rv != APR_SUCCESS){
+        return DECLINED;
+    }
+
+    /* values are stored as "mac exp iat auth_time jti user", a forged value is a miss */
+    value[value_len] = 0;
+    if(value_len <= sizeof(mac) || value[sizeof(mac)] != ' '){
+        return DECLINED;
+    }
+    last = (char *)value + sizeof(mac) + 1;
+    remote_cache_mac(secret, digest, last, value_len - sizeof(mac) - 1, mac);
+    if(CRYPTO_memcmp(mac, value, sizeof(mac))){
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(01810)
+                      "Token cache entry with a wrong MAC ignored");
+        return DECLINED;
+    }
+    for(i=0;i<4;i++){
+        fields[i] = last;
+        last = strchr(last, ' ');
+        if(!last){
+            return DECLINED;
+        }
+        *last++ = 0;
+    }
+    fields[4] = last;
+    if(strlen(fields[4]) >= CACHED_USER_SIZE){
+        return DECLINED;
+    }
+
+    vt->exp = (apr_time_t)apr_atoi64(fields[0]);
+    vt->iat = (apr_time_t)apr_atoi64(fields[1]);
+    vt->auth_time = (apr_time_t)apr_atoi64(fields[2]);
+    vt->jti = (apr_uint64_t)apr_atoi64(fields[3]);
+    apr_cpystrn(vt->user, fields[4], CACHED_USER_SIZE);
+    return verified_token_check(r, vt);
+}
+
+static void remote_cache_store(request_rec *r, const unsigned char *digest, const verified_token *vt){
+    remote_cache_write entry;
+    const char *secret = (const char *)get_config_value(r, dir_signature_secret);
+
+    if(!remote_cache.instance || !secret){
+        return;
+    }
+
+#if APR_HAS_THREADS
+    if(remote_cache.writer){
+        apr_thread_mutex_lock(remote_cache.queue_mutex);
+        /* when the queue is full the entry is dropped, the cache is best effort */
+        if(remote_cache.queued < SOCACHE_QUEUE_SIZE){
+            remote_cache_write *queued = &remote_cache.queue[remote_cache.queued++];
+            memcpy(queued->digest, digest, TOKEN_DIGEST_SIZE);
+            queued->token = *vt;
+            queued->secret = secret;
+            apr_thread_cond_signal(remote_cache.queue_cond);
+        }
+        apr_thread_mutex_unlock(remote_cache.queue_mutex);
+        return;
+    }
+#endif
+
+    memcpy(entry.digest, digest, TOKEN_DIGEST_SIZE);
+    entry.token = *vt;
+    entry.secret = secret;
+    remote_cache_write_entry(r->pool, &entry);
+}
+
+static void remote_cache_write_entry(apr_pool_t *p, const remote_cache_write *entry){
+    char value[SOCACHE_VALUE_SIZE];
+    char *fields = value + 2 * SOCACHE_MAC_SIZE + 1;
+    int value_len = apr_snprintf(fields, sizeof(value) - 2 * SOCACHE_MAC_SIZE - 1,
+                                 "%" APR_TIME_T_FMT " %" APR_TIME_T_FMT " %" APR_TIME_T_FMT " %" APR_INT64_T_FMT " %s",
+                                 entry->token.exp, entry->token.iat, entry->token.auth_time,
+                                 (apr_int64_t)entry->token.jti, entry->token.user);
+
+    remote_cache_mac(entry->secret, entry->digest, fields, value_len, value);
+    value[2 * SOCACHE_MAC_SIZE] = ' ';
+    value_len += 2 * SOCACHE_MAC_SIZE + 1;
+
+    if(remote_cache.mutex){
+        apr_global_mutex_lock(remote_cache.mutex);
+    }
+    remote_cache.provider->store(remote_cache.instance, remote_cache.server, entry->digest, TOKEN_DIGEST_SIZE,
+                                 apr_time_from_sec(entry->token.exp), (unsigned char *)value, value_len, p);
+    if(remote_cache.mutex){
+        apr_global_mutex_unlock(remote_cache.mutex);
+    }
+}
+
+/* Hex HMAC-SHA256 of digest || fields, keyed with the signature secret */
+static void remote_cache_mac(const char *secret, const unsigned char *digest, const char *fields, apr_size_t len, char *hex){
+    static const char digits[] = "0123456789abcdef";
+    unsigned char data[TOKEN_DIGEST_SIZE + SOCACHE_VALUE_SIZE];
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    int i;
+
+    memcpy(data, digest, TOKEN_DIGEST_SIZE);
+    memcpy(data + TOKEN_DIGEST_SIZE, fields, len);
+    HMAC(EVP_sha256(), secret, (int)strlen(secret), data, TOKEN_DIGEST_SIZE + len, mac, NULL);
+    for(i=0;i<SOCACHE_MAC_SIZE;i++){
+        hex[2*i] = digits[mac[i] >> 4];
+        hex[2*i+1] = digits[mac[i] & 0x0f];
+    }
+}
+
+#if APR_HAS_THREADS
+/* Drains the whole queue at once, so that stores are written in batches */
+static void *APR_THREAD_FUNC remote_cache_writer(apr_thread_t *thread, void *data){
+    remote_cache_write batch[SOCACHE_QUEUE_SIZE];
+    apr_pool_t *p;
+    int count, i;
+
+    apr_pool_create(&p, NULL);
+    for(;;){
+        apr_thread_mutex_lock(remote_cache.queue_mutex);
+        while(!remote_cache.queued && !remote_cache.stopping){
+            apr_thread_cond_wait(remote_cache.queue_cond, remote_cache.queue_mutex);
+        }
+        if(remote_cache.stopping){
+            apr_thread_mutex_unlock(remote_cache.queue_mutex);
+            break;
+        }
+        count = remote_cache.queued;
+        memcpy(batch, remote_cache.queue, count * sizeof(remote_cache_write));
+        remote_cache.queued = 0;
+        apr_thread_mutex_unlock(remote_cache.queue_mutex);
+
+        for(i=0;i<count;i++){
+            remote_cache_write_entry(p, &batch[i]);
+        }
+        apr_pool_clear(p);
+    }
+    apr_pool_destroy(p);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t remote_cache_stop_writer(void *data){
+    remote_cache_t *cache = (remote_cache_t *)data;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(cache->queue_mutex);
+    cache->stopping = 1;
+    apr_thread_cond_signal(cache->queue_cond);
+    apr_thread_mutex_unlock(cache->queue_mutex);
+    apr_thread_join(&rv, cache->writer);
+    cache->writer = NULL;
+    return APR_SUCCESS;
+}
+#endif
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  REVOCATION ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+/*
+The segment is attached to the process pool, which survives restarts, so that
+revoked tokens do not become valid again on apachectl graceful.
+*/
+static apr_status_t shm_attach_persistent(server_rec *s, const char *key, apr_size_t size, apr_shm_t **shm){
+    apr_pool_t *pproc = s->process->pool;
+    apr_status_t rv;
+
+    *shm = NULL;
+    apr_pool_userdata_get((void **)shm, key, pproc);
+    if(*shm && apr_shm_size_get(*shm) != size){
+        apr_shm_destroy(*shm);
+        *shm = NULL;
+    }
+    if(!*shm){
+        rv = apr_shm_create(shm, size, NULL, pproc);
+        if(rv != APR_SUCCESS){
+            return rv;
+        }
+        memset(apr_shm_baseaddr_get(*shm), 0, size);
+        apr_pool_userdata_set(*shm, key, apr_pool_cleanup_null, pproc);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t revocation_table_init(apr_pool_t *pconf, server_rec *s, apr_uint32_t entries){
+    apr_uint32_t buckets = (entries + REVOCATION_BUCKET_SIZE - 1) / REVOCATION_BUCKET_SIZE;
+    apr_size_t size = (apr_size_t)buckets * REVOCATION_BUCKET_SIZE * sizeof(revocation_entry);
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    rv = shm_attach_persistent(s, REVOCATION_SHM_KEY, size, &shm);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    rv = ap_global_mutex_create(&revocation_table.mutex, NULL, REVOCATION_MUTEX_TYPE, NULL, s, pconf, 0);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    revocation_table.shm = shm;
+    revocation_table.entries = (revocation_entry *)apr_shm_baseaddr_get(shm);
+    revocation_table.buckets = buckets;
+    return APR_SUCCESS;
+}
+
+static void revocation_table_child_init(apr_pool_t *p, server_rec *s){
+    if(revocation_table.mutex){
+        apr_global_mutex_child_init(&revocation_table.mutex, apr_global_mutex_lockfile(revocation_table.mutex), p);
+    }
+}
+
+static apr_status_t revocation_table_add(apr_uint64_t jti, apr_time_t exp){
+    revocation_entry *bucket;
+    revocation_entry *slot = NULL;
+    apr_time_t now = apr_time_sec(apr_time_now());
+    apr_status_t rv;
+    int i;
+
+    if(!revocation_table.buckets){
+        return APR_ENOTIMPL;
+    }
+
+    bucket = &revocation_table.entries[(jti % revocation_table.buckets) * REVOCATION_BUCKET_SIZE];
+
+    rv = apr_global_mutex_lock(revocation_table.mutex);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    for(i=0;i<REVOCATION_BUCKET_SIZE;i++){
+        if(apr_atomic_read64(&bucket[i].jti) == jti){
+            slot = &bucket[i];
+            break;
+        }
+        if(!slot && (apr_time_t)apr_atomic_read64(&bucket[i].exp) < now){
+            slot = &bucket[i];
+        }
+    }
+    if(slot){
+        /* hide the slot while it changes hands, readers match the jti first */
+        if(apr_atomic_read64(&slot->jti) != jti){
+            apr_atomic_set64(&slot->jti, 0);
+        }
+        apr_atomic_set64(&slot->exp, (apr_uint64_t)exp);
+        apr_atomic_set64(&slot->jti, jti);
+        rv = APR_SUCCESS;
+    }else{
+        rv = APR_ENOSPC;
+    }
+    apr_global_mutex_unlock(revocation_table.mutex);
+    return rv;
+}
+
+static int revocation_table_contains(apr_uint64_t jti, apr_time_t now){
+    revocation_entry *bucket;
+    int i;
+
+    if(!revocation_table.buckets || !jti){
+        return 0;
+    }
+
+    bucket = &revocation_table.entries[(jti % revocation_table.buckets) * REVOCATION_BUCKET_SIZE];
+    for(i=0;i<REVOCATION_BUCKET_SIZE;i++){
+        if(apr_atomic_read64(&bucket[i].jti) == jti){
+            return (apr_time_t)apr_atomic_read64(&bucket[i].exp) >= now;
+        }
+    }
+    return 0;
+}
+
+static int token_revoked(request_rec *r, apr_uint64_t jti){
+    if(!jti){
+        return 0;
+    }
+    return revocation_table_contains(jti, apr_time_sec(r->request_time))
+        || revocation_list_contains(r, jti);
+}
+
+static apr_status_t revocation_list_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, auth_jwt_config_rec *sconf){
+    apr_uint32_t capacity = (apr_uint32_t)sconf->revocation_file_entries;
+    apr_uint32_t blocks = (apr_uint32_t)(((apr_uint64_t)capacity * BLOOM_BITS_PER_ENTRY + 511) / 512);
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    revocation_list.path = sconf->revocation_file;
+    revocation_list.slot_size = APR_ALIGN_DEFAULT(sizeof(revocation_list_slot))
+                              + (apr_size_t)blocks * BLOOM_BLOCK_WORDS * sizeof(apr_uint64_t)
+                              + (apr_size_t)capacity * sizeof(apr_uint64_t);
+
+    rv = apr_shm_create(&revocation_list.shm, APR_ALIGN_DEFAULT(sizeof(revocation_list_header))
+                        + 2 * revocation_list.slot_size, NULL, pconf);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    revocation_list.header = (revocation_list_header *)apr_shm_baseaddr_get(revocation_list.shm);
+    memset(revocation_list.header, 0, apr_shm_size_get(revocation_list.shm));
+    revocation_list.header->capacity = capacity;
+    revocation_list.header->blocks = blocks;
+
+    rv = ap_global_mutex_create(&revocation_list.mutex, NULL, REVOCATION_LIST_MUTEX_TYPE, NULL, s, pconf, 0);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    rv = apr_stat(&finfo, revocation_list.path, APR_FINFO_MTIME, ptemp);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    return revocation_list_compile(ptemp, finfo.mtime);
+}
+
+static void revocation_list_child_init(apr_pool_t *p, server_rec *s){
+    if(revocation_list.mutex){
+        apr_global_mutex_child_init(&revocation_list.mutex, apr_global_mutex_lockfile(revocation_list.mutex), p);
+    }
+}
+
+static revocation_list_slot *revocation_list_slot_get(apr_uint32_t index){
+    return (revocation_list_slot *)((char *)revocation_list.header + APR_ALIGN_DEFAULT(sizeof(revocation_list_header))
+                                    + index * revocation_list.slot_size);
+}
+
+#define REVOCATION_LIST_BLOOM(slot) ((apr_uint64_t *)((char *)(slot) + APR_ALIGN_DEFAULT(sizeof(revocation_list_slot))))
+#define REVOCATION_LIST_IDS(slot) (REVOCATION_LIST_BLOOM(slot) + revocation_list.header->blocks * BLOOM_BLOCK_WORDS)
+
+static void bloom_positions(apr_uint64_t jti, apr_uint32_t blocks, apr_uint32_t *block, unsigned int *positions){
+    apr_uint64_t x = jti;
+    int i;
+
+    *block = (apr_uint32_t)((jti >> 32) % blocks);
+    for(i=0;i<BLOOM_HASHES;i++){
+        x = x * APR_UINT64_C(0x9E3779B97F4A7C15) + APR_UINT64_C(0x632BE59BD9B4E019);
+        positions[i] = (unsigned int)(x >> 55);
+    }
+}
+
+static int compare_jti(const void *a, const void *b){
+    apr_uint64_t x = *(const apr_uint64_t *)a;
+    apr_uint64_t y = *(const apr_uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Compiles the file into the inactive slot, then makes it the active one */
+static apr_status_t revocation_list_compile(apr_pool_t *p, apr_time_t mtime){
+    revocation_list_header *header = revocation_list.header;
+    apr_uint32_t inactive = !apr_atomic_read32(&header->active);
+    revocation_list_slot *slot = revocation_list_slot_get(inactive);
+    apr_array_header_t *ids = apr_array_make(p, 1024, sizeof(apr_uint64_t));
+    apr_uint64_t *sorted, *bloom;
+    apr_file_t *file;
+    char line[HUGE_STRING_LEN];
+    apr_status_t rv;
+    int i, count = 0;
+
+    rv = apr_file_open(&file, revocation_list.path, APR_READ, APR_OS_DEFAULT, p);
+    if(rv != APR_SUCCESS){
+        header->failed_mtime = mtime;
+        return rv;
+    }
+    while(apr_file_gets(line, sizeof(line), file) == APR_SUCCESS){
+        char *jti = line;
+        char *end;
+        while(apr_isspace(*jti)){
+            jti++;
+        }
+        end = jti + strlen(jti);
+        while(end > jti && apr_isspace(end[-1])){
+            *--end = 0;
+        }
+        if(!*jti || *jti == '#'){
+            continue;
+        }
+        APR_ARRAY_PUSH(ids, apr_uint64_t) = claim_hash(jti);
+    }
+    apr_file_close(file);
+
+    if((apr_uint32_t)ids->nelts > header->capacity){
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, APLOGNO(01810)
+                      "Revocation file %s lists %d jti, more than the %u allowed, it is not loaded",
+                      revocation_list.path, ids->nelts, header->capacity);
+        header->failed_mtime = mtime;
+        return APR_ENOSPC;
+    }
+
+    sorted = (apr_uint64_t *)ids->elts;
+    qsort(sorted, ids->nelts, sizeof(apr_uint64_t), compare_jti);
+
+    apr_atomic_inc32(&slot->seq);
+    bloom = REVOCATION_LIST_BLOOM(slot);
+    memset(bloom, 0, (apr_size_t)header->blocks * BLOOM_BLOCK_WORDS * sizeof(apr_uint64_t));
+    for(i=0;i<ids->nelts;i++){
+        apr_uint32_t block;
+        unsigned int positions[BLOOM_HASHES];
+        int j;
+
+        if(i && sorted[i] == sorted[i-1]){
+            continue;
+        }
+        REVOCATION_LIST_IDS(slot)[count++] = sorted[i];
+        bloom_positions(sorted[i], header->blocks, &block, positions);
+        for(j=0;j<BLOOM_HASHES;j++){
+            bloom[block * BLOOM_BLOCK_WORDS + (positions[j] >> 6)] |= APR_UINT64_C(1) << (positions[j] & 63);
+        }
+    }
+    slot->count = count;
+    slot->mtime = mtime;
+    apr_atomic_inc32(&slot->seq);
+    apr_atomic_set32(&header->active, inactive);
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, 0, p, APLOGNO(01810)
+                  "Revocation file %s loaded with %d jti", revocation_list.path, count);
+    return APR_SUCCESS;
+}
+
+static void revocation_list_refresh(request_rec *r){
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(r->request_time);
+    apr_uint32_t last = apr_atomic_read32(&revocation_list.last_check);
+    apr_finfo_t finfo;
+    apr_pool_t *p;
+
+    /* a single thread per child and per second looks at the file */
+    if(now == last || apr_atomic_cas32(&revocation_list.last_check, now, last) != last){
+        return;
+    }
+    if(apr_stat(&finfo, revocation_list.path, APR_FINFO_MTIME, r->pool) != APR_SUCCESS
+        || finfo.mtime == revocation_list.header->failed_mtime
+        || finfo.mtime == revocation_list_slot_get(apr_atomic_read32(&revocation_list.header->active))->mtime){
+        return;
+    }
+    /* another child is already compiling the new list */
+    if(apr_global_mutex_trylock(revocation_list.mutex) != APR_SUCCESS){
+        return;
+    }
+    if(finfo.mtime != revocation_list.header->failed_mtime
+        && finfo.mtime != revocation_list_slot_get(apr_atomic_read32(&revocation_list.header->active))->mtime
+        && apr_pool_create(&p, r->pool) == APR_SUCCESS){
+        revocation_list_compile(p, finfo.mtime);
+        apr_pool_destroy(p);
+    }
+    apr_global_mutex_unlock(revocation_list.mutex);
+}
+
+static int revocation_list_contains(request_rec *r, apr_uint64_t jti){
+    revocation_list_slot *slot;
+    apr_uint64_t *bloom;
+    apr_uint32_t seq, block;
+    unsigned int positions[BLOOM_HASHES];
+    int found, i, attempts;
+
+    if(!revocation_list.header){
+        return 0;
+    }
+    revocation_list_refresh(r);
+
+    bloom_positions(jti, revocation_list.header->blocks, &block, positions);
+    for(attempts = 0; attempts < 3; attempts++){
+        slot = revocation_list_slot_get(apr_atomic_read32(&revocation_list.header->active));
+        seq = apr_atomic_read32(&slot->seq);
+        if(seq & 1){
+            continue;
+        }
+
+        found = 1;
+        bloom = REVOCATION_LIST_BLOOM(slot) + block * BLOOM_BLOCK_WORDS;
+        for(i=0;i<BLOOM_HASHES && found;i++){
+            found = (bloom[positions[i] >> 6] >> (positions[i] & 63)) & 1;
+        }
+        if(found){
+            found = bsearch(&jti, REVOCATION_LIST_IDS(slot), slot->count, sizeof(apr_uint64_t), compare_jti) != NULL;
+        }
+
+        if(apr_atomic_cas32(&slot->seq, seq, seq) == seq){
+            return found;
+        }
+    }
+    /* the list keeps changing, be conservative */
+    return 1;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  USER INVALIDATION ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static apr_status_t user_invalidation_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s, auth_jwt_config_rec *sconf){
+    apr_uint32_t buckets = ((apr_uint32_t)sconf->user_invalidation_table_size + REVOCATION_BUCKET_SIZE - 1) / REVOCATION_BUCKET_SIZE;
+    apr_size_t size = APR_ALIGN_DEFAULT(sizeof(user_invalidation_header))
+                    + (apr_size_t)buckets * REVOCATION_BUCKET_SIZE * sizeof(user_invalidation_entry);
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    rv = shm_attach_persistent(s, USER_INVALIDATION_SHM_KEY, size, &user_invalidation.shm);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    rv = ap_global_mutex_create(&user_invalidation.mutex, NULL, USER_INVALIDATION_MUTEX_TYPE, NULL, s, pconf, 0);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    user_invalidation.header = (user_invalidation_header *)apr_shm_baseaddr_get(user_invalidation.shm);
+    user_invalidation.entries = (user_invalidation_entry *)((char *)user_invalidation.header
+                                + APR_ALIGN_DEFAULT(sizeof(user_invalidation_header)));
+    user_invalidation.buckets = buckets;
+    user_invalidation.lifetime = sconf->user_invalidation_lifetime;
+    user_invalidation.path = sconf->user_invalidation_file;
+
+    if(user_invalidation.path){
+        rv = apr_stat(&finfo, user_invalidation.path, APR_FINFO_MTIME, ptemp);
+        if(rv == APR_SUCCESS && finfo.mtime != user_invalidation.header->file_mtime){
+            rv = user_invalidation_load(ptemp, finfo.mtime);
+        }
+    }
+    return rv;
+}
+
+static void user_invalidation_child_init(apr_pool_t *p, server_rec *s){
+    if(user_invalidation.mutex){
+        apr_global_mutex_child_init(&user_invalidation.mutex, apr_global_mutex_lockfile(user_invalidation.mutex), p);
+    }
+}
+
+/* The caller must hold the global mutex */
+static apr_status_t user_invalidation_set_locked(apr_uint64_t user, apr_time_t not_before){
+    user_invalidation_entry *bucket;
+    user_invalidation_entry *slot = NULL;
+    apr_time_t now = apr_time_sec(apr_time_now());
+    int i;
+
+    bucket = &user_invalidation.entries[(user % user_invalidation.buckets) * REVOCATION_BUCKET_SIZE];
+    for(i=0;i<REVOCATION_BUCKET_SIZE;i++){
+        if(apr_atomic_read64(&bucket[i].user) == user){
+            slot = &bucket[i];
+            break;
+        }
+        if(!slot && (apr_time_t)apr_atomic_read64(&bucket[i].until) < now){
+            slot = &bucket[i];
+        }
+    }
+    if(!slot){
+        return APR_ENOSPC;
+    }
+
+    /* the timestamp may go backwards, e.g. to undo a mistaken invalidation */
+    if(apr_atomic_read64(&slot->user) != user){
+        apr_atomic_set64(&slot->user, 0);
+    }
+    apr_atomic_set64(&slot->not_before, (apr_uint64_t)not_before);
+    apr_atomic_set64(&slot->until, (apr_uint64_t)(not_before > APR_INT64_MAX - user_invalidation.lifetime
+                                                  ? APR_INT64_MAX : not_before + user_invalidation.lifetime));
+    apr_atomic_set64(&slot->user, user);
+    return APR_SUCCESS;
+}
+
+static apr_status_t user_invalidation_set(const char *user, apr_time_t not_before){
+    apr_status_t rv;
+
+    if(!user_invalidation.buckets){
+        return APR_ENOTIMPL;
+    }
+    rv = apr_global_mutex_lock(user_invalidation.mutex);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    rv = user_invalidation_set_locked(claim_hash(user), not_before);
+    apr_global_mutex_unlock(user_invalidation.mutex);
+    return rv;
+}
+
+/* Applies the file, the caller must hold the global mutex or be the parent */
+static apr_status_t user_invalidation_load(apr_pool_t *p, apr_time_t mtime){
+    apr_file_t *file;
+    char line[HUGE_STRING_LEN];
+    apr_status_t rv;
+    int count = 0;
+
+    rv = apr_file_open(&file, user_invalidation.path, APR_READ, APR_OS_DEFAULT, p);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    while(apr_file_gets(line, sizeof(line), file) == APR_SUCCESS){
+        const char *cursor = line;
+        char *user = ap_getword_white(p, &cursor);
+        char *timestamp = ap_getword_white(p, &cursor);
+
+        if(!*user || *user == '#'){
+            continue;
+        }
+        if(!*timestamp || !apr_isdigit(*timestamp)){
+            ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, APLOGNO(01810)
+                          "Invalid line for user %s in %s", user, user_invalidation.path);
+            continue;
+        }
+        if(user_invalidation_set_locked(claim_hash(user), (apr_time_t)apr_atoi64(timestamp)) != APR_SUCCESS){
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, p, APLOGNO(01810)
+                          "User invalidation table is full, cannot invalidate tokens of %s", user);
+        }
+        count++;
+    }
+    apr_file_close(file);
+
+    user_invalidation.header->file_mtime = mtime;
+    ap_log_perror(APLOG_MARK, APLOG_INFO, 0, p, APLOGNO(01810)
+                  "User invalidation file %s loaded with %d users", user_invalidation.path, count);
+    return APR_SUCCESS;
+}
+
+static void user_invalidation_refresh(request_rec *r){
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(r->request_time);
+    apr_uint32_t last = apr_atomic_read32(&user_invalidation.last_check);
+    apr_finfo_t finfo;
+    apr_pool_t *p;
+
+    if(!user_invalidation.path || now == last
+        || apr_atomic_cas32(&user_invalidation.last_check, now, last) != last){
+        return;
+    }
+    if(apr_stat(&finfo, user_invalidation.path, APR_FINFO_MTIME, r->pool) != APR_SUCCESS
+        || finfo.mtime == user_invalidation.header->file_mtime){
+        return;
+    }
+    if(apr_global_mutex_trylock(user_invalidation.mutex) != APR_SUCCESS){
+        return;
+    }
+    if(finfo.mtime != user_invalidation.header->file_mtime && apr_pool_create(&p, r->pool) == APR_SUCCESS){
+        user_invalidation_load(p, finfo.mtime);
+        apr_pool_destroy(p);
+    }
+    apr_global_mutex_unlock(user_invalidation.mutex);
+}
+
+/*
+A token is invalid when it has been issued before the user's timestamp. Tokens
+issued during that very second are kept, so that a user can log in again at
+once after an invalidation, e.g. after a password reset.
+*/
+static int user_invalidated(request_rec *r, const char *user, apr_time_t iat){
+    user_invalidation_entry *bucket;
+    apr_uint64_t hash;
+    int i;
+
+    if(!user_invalidation.buckets){
+        return 0;
+    }
+    user_invalidation_refresh(r);
+
+    hash = claim_hash(user);
+    bucket = &user_invalidation.entries[(hash % user_invalidation.buckets) * REVOCATION_BUCKET_SIZE];
+    for(i=0;i<REVOCATION_BUCKET_SIZE;i++){
+        if(apr_atomic_read64(&bucket[i].user) == hash){
+            return iat < (apr_time_t)apr_atomic_read64(&bucket[i].not_before);
+        }
+    }
+    return 0;
+}
+
+/*
+Invalidates every token of a user issued before now, or before the timestamp
+given in the "before" field, which cannot be in the future. Users may only
+invalidate their own tokens, unless AuthJWTInvalidateUsers lists them.
+*/
+static int auth_jwt_invalidate_handler(request_rec *r){
+  static const char *fields[] = {"user", "before"};
+  const char *values[2];
+
+  if(!r->handler || strcmp(r->handler, JWT_INVALIDATE_HANDLER)){
+    return DECLINED;
+  }
+
+  if(r->method_number != M_POST){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01811)
+          "the " JWT_INVALIDATE_HANDLER " only supports the POST method for %s",
+                      r->uri);
+    return HTTP_METHOD_NOT_ALLOWED;
+  }
+
+  if(!r->user){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                  "the " JWT_INVALIDATE_HANDLER " requires an authenticated user for %s", r->uri);
+    return HTTP_FORBIDDEN;
+  }
+
+  /* "before" is optional */
+  int res = read_fields(r, fields, 2, values);
+  if(res != OK && res != DECLINED){
+    return res;
+  }
+
+  const char *user = values[0];
+  apr_time_t not_before = apr_time_sec(r->request_time);
+  if(!user || !*user){
+    return HTTP_BAD_REQUEST;
+  }
+  if(values[1] && apr_isdigit(*values[1])){
+    not_before = (apr_time_t)apr_atoi64(values[1]);
+  }
+
+  auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config, &auth_jwt_module);
+  if(strcmp(user, r->user) && !user_listed(conf->invalidate_users, r->user)){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                  "user %s is not allowed by AuthJWTInvalidateUsers to invalidate tokens of %s", r->user, user);
+    return HTTP_FORBIDDEN;
+  }
+  if(not_before > apr_time_sec(r->request_time)){
+    not_before = apr_time_sec(r->request_time);
+  }
+
+  apr_status_t rv = user_invalidation_set(user, not_before);
+  if(rv != APR_SUCCESS){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01810)
+                  "Cannot invalidate tokens of %s, the user invalidation table is full or disabled", user);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  ap_set_content_type(r, "application/json");
+  ap_rprintf(r, "{\"not_before\":%" APR_TIME_T_FMT "}", not_before);
+  return OK;
+}
+
+/*
+Exchanges a refresh_token field for a new token of the user it was delivered
+to, without calling the authentication providers. Refresh tokens are revoked
+by logging out with them, or by invalidating the tokens of their user.
+*/
+static int auth_jwt_refresh_handler(request_rec *r){
+  static const char *fields[] = {"refresh_token"};
+  const char *refresh_token;
+  const char *user;
+  int rv;
+
+  if(!r->handler || strcmp(r->handler, JWT_REFRESH_HANDLER)){
+    return DECLINED;
+  }
+
+  if(r->method_number != M_POST){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01811)
+          "the " JWT_REFRESH_HANDLER " only supports the POST method for %s",
+                      r->uri);
+    return HTTP_METHOD_NOT_ALLOWED;
+  }
+
+  if(!refresh_table.buckets){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+          "the " JWT_REFRESH_HANDLER " needs AuthJWTRefreshTableSize for %s",
+                      r->uri);
+    return HTTP_NOT_FOUND;
+  }
+
+  rv = read_fields(r, fields, 1, &refresh_token);
+  if(rv == DECLINED){
+    return HTTP_BAD_REQUEST;
+  }else if(rv != OK){
+    return rv;
+  }
+
+  rv = refresh_table_lookup(r, refresh_token, &user);
+  if(rv != OK){
+    return rv;
+  }
+
+  r->user = (char *)user;
+  return token_respond(r, user, NULL);
+}
+
+static apr_status_t refresh_table_init(apr_pool_t *pconf, server_rec *s, auth_jwt_config_rec *sconf){
+    apr_uint32_t buckets = ((apr_uint32_t)sconf->refresh_table_size + REFRESH_BUCKET_SIZE - 1) / REFRESH_BUCKET_SIZE;
+    apr_size_t size = (apr_size_t)buckets * REFRESH_BUCKET_SIZE * sizeof(refresh_entry);
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    rv = shm_attach_persistent(s, REFRESH_SHM_KEY, size, &shm);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    rv = ap_global_mutex_create(&refresh_table.mutex, NULL, REFRESH_MUTEX_TYPE, NULL, s, pconf, 0);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    refresh_table.shm = shm;
+    refresh_table.entries = (refresh_entry *)apr_shm_baseaddr_get(shm);
+    refresh_table.buckets = buckets;
+    refresh_table.lifetime = sconf->refresh_lifetime;
+    return APR_SUCCESS;
+}
+
+static void refresh_table_child_init(apr_pool_t *p, server_rec *s){
+    if(refresh_table.mutex){
+        apr_global_mutex_child_init(&refresh_table.mutex, apr_global_mutex_lockfile(refresh_table.mutex), p);
+    }
+}
+
+static void refresh_digest(const char *refresh_token, unsigned char *digest){
+    apr_sha1_ctx_t context;
+
+    apr_sha1_init(&context);
+    apr_sha1_update(&context, refresh_token, strlen(refresh_token));
+    apr_sha1_final(digest, &context);
+}
+
+static void refresh_issuer_digest(request_rec *r, unsigned char *digest){
+    static const jwt_directive directives[] = {dir_signature_secret, dir_signature_algorithm, dir_iss, dir_aud, dir_sub};
+    apr_sha1_ctx_t context;
+    int i;
+
+    apr_sha1_init(&context);
+    for(i=0;i<(int)(sizeof(directives)/sizeof(directives[0]));i++){
+        const char *value = (const char *)get_config_value(r, directives[i]);
+        /* an unset value differs from an empty one */
+        apr_sha1_update(&context, value ? "+" : "-", 1);
+        if(value){
+            apr_sha1_update(&context, value, strlen(value) + 1);
+        }
+    }
+    apr_sha1_final(digest, &context);
+}
+
+/* Must be called with the mutex held */
+static refresh_entry *refresh_table_find(const unsigned char *digest, apr_time_t now){
+    refresh_entry *bucket = &refresh_table.entries[(digest_hash(digest) % refresh_table.buckets) * REFRESH_BUCKET_SIZE];
+    int i;
+
+    for(i=0;i<REFRESH_BUCKET_SIZE;i++){
+        if(bucket[i].exp >= now && !memcmp(bucket[i].digest, digest, APR_SHA1_DIGESTSIZE)){
+            return &bucket[i];
+        }
+    }
+    return NULL;
+}
+
+/* Delivers a new refresh token to user, or NULL if there is no room left */
+static const char *refresh_table_issue(request_rec *r, const char *user){
+    unsigned char bytes[REFRESH_TOKEN_SIZE];
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    unsigned char issuer[APR_SHA1_DIGESTSIZE];
+    char *refresh_token;
+    refresh_entry *bucket, *slot = NULL;
+    apr_time_t now = apr_time_sec(apr_time_now());
+    int i;
+
+    if(strlen(user) >= CACHED_USER_SIZE || random_bytes(bytes, REFRESH_TOKEN_SIZE) != APR_SUCCESS){
+        return NULL;
+    }
+    refresh_token = apr_palloc(r->pool, (REFRESH_TOKEN_SIZE + 2) / 3 * 4 + 1);
+    refresh_token[base64url_encode(refresh_token, bytes, REFRESH_TOKEN_SIZE)] = 0;
+    refresh_digest(refresh_token, digest);
+    refresh_issuer_digest(r, issuer);
+
+    bucket = &refresh_table.entries[(digest_hash(digest) % refresh_table.buckets) * REFRESH_BUCKET_SIZE];
+    if(apr_global_mutex_lock(refresh_table.mutex) != APR_SUCCESS){
+        return NULL;
+    }
+    for(i=0;i<REFRESH_BUCKET_SIZE;i++){
+        if(bucket[i].exp < now){
+            slot = &bucket[i];
+            break;
+        }
+    }
+    if(slot){
+        memcpy(slot->digest, digest, APR_SHA1_DIGESTSIZE);
+        memcpy(slot->issuer, issuer, APR_SHA1_DIGESTSIZE);
+        slot->iat = now;
+        slot->exp = now + refresh_table.lifetime;
+        apr_cpystrn(slot->user, user, CACHED_USER_SIZE);
+    }
+    apr_global_mutex_unlock(refresh_table.mutex);
+
+    if(!slot){
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(01810)
+                      "No room left for a refresh token of %s", user);
+        return NULL;
+    }
+    return refresh_token;
+}
+
+static int refresh_table_lookup(request_rec *r, const char *refresh_token, const char **user){
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    unsigned char issuer[APR_SHA1_DIGESTSIZE];
+    apr_time_t now = apr_time_sec(r->request_time);
+    refresh_entry *entry;
+    apr_time_t iat = 0;
+    int same_issuer = 0;
+
+    refresh_digest(refresh_token, digest);
+    refresh_issuer_digest(r, issuer);
+
+    *user = NULL;
+    if(apr_global_mutex_lock(refresh_table.mutex) != APR_SUCCESS){
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    entry = refresh_table_find(digest, now);
+    if(entry){
+        *user = apr_pstrdup(r->pool, entry->user);
+        iat = entry->iat;
+        same_issuer = !memcmp(entry->issuer, issuer, APR_SHA1_DIGESTSIZE);
+    }
+    apr_global_mutex_unlock(refresh_table.mutex);
+
+    if(!*user){
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(01810)
+                      "Unknown or expired refresh token");
+        return HTTP_UNAUTHORIZED;
+    }
+    if(!same_issuer){
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(01810)
+                      "Refresh token of %s was delivered with another configuration than %s", *user, r->uri);
+        *user = NULL;
+        return HTTP_UNAUTHORIZED;
+    }
+    if(user_invalidated(r, *user, iat)){
+        refresh_table_remove(refresh_token);
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(01810)
+                      "Refresh token of %s was invalidated", *user);
+        return HTTP_UNAUTHORIZED;
+    }
+    return OK;
+}
+
+static void refresh_table_remove(const char *refresh_token){
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    refresh_entry *entry;
+
+    refresh_digest(refresh_token, digest);
+
+    if(apr_global_mutex_lock(refresh_table.mutex) != APR_SUCCESS){
+        return;
+    }
+    entry = refresh_table_find(digest, apr_time_sec(apr_time_now()));
+    if(entry){
+        entry->exp = 0;
+    }
+    apr_global_mutex_unlock(refresh_table.mutex);
+}
+
+/*
+Delivers a token for each subject of the request body, one per line. Only the
+users listed by AuthJWTMintUsers for the location are served. Tokens are sent
+back in order as newline-delimited JSON, each chunk of subjects as soon as it
+is signed.
+*/
+static int auth_jwt_mint_handler(request_rec *r){
+
+  if(!r->handler || strcmp(r->handler, JWT_MINT_HANDLER)){
+    return DECLINED;
+  }
+
+  if(r->method_number != M_POST){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01811)
+          "the " JWT_MINT_HANDLER " only supports the POST method for %s",
+                      r->uri);
+    return HTTP_METHOD_NOT_ALLOWED;
+  }
+
+  if(!r->user){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+          "the " JWT_MINT_HANDLER " must be restricted to authenticated clients for %s",
+                      r->uri);
+    return HTTP_FORBIDDEN;
+  }
+
+  auth_jwt_config_rec *conf = ap_get_module_config(r->per_dir_config, &auth_jwt_module);
+  int i;
+  if(!user_listed(conf->mint_users, r->user)){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+          "user %s is not allowed by AuthJWTMintUsers to mint tokens for %s", r->user, r->uri);
+    return HTTP_FORBIDDEN;
+  }
+
+  apr_array_header_t *subjects;
+  int res = mint_read_subjects(r, &subjects);
+  if(res != OK){
+    return res;
+  }
+
+  const token_template *tpl;
+  res = token_template_get(r, &tpl);
+  if(res != OK){
+    return res;
+  }
+
+  auth_jwt_config_rec *sconf = ap_get_module_config(r->server->module_config, &auth_jwt_module);
+  mint_batch *batch = apr_pcalloc(r->pool, sizeof(mint_batch));
+  batch->count = (subjects->nelts + MINT_CHUNK_SIZE - 1) / MINT_CHUNK_SIZE;
+  batch->chunks = apr_pcalloc(r->pool, batch->count * sizeof(mint_chunk));
+  batch->window = sconf->mint_threads > 0 ? MINT_CHUNKS_PER_THREAD * sconf->mint_threads : 1;
+#if APR_HAS_THREADS
+  if(mint_pool
+     && (apr_thread_mutex_create(&batch->mutex, APR_THREAD_MUTEX_DEFAULT, r->pool) != APR_SUCCESS
+         || apr_thread_cond_create(&batch->cond, r->pool) != APR_SUCCESS)){
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+#endif
+
+  for(i = 0; i < batch->count; i++){
+    mint_chunk *chunk = &batch->chunks[i];
+    chunk->batch = batch;
+    chunk->tpl = tpl;
+    chunk->subjects = (char **)subjects->elts + i * MINT_CHUNK_SIZE;
+    chunk->count = i < batch->count - 1 ? MINT_CHUNK_SIZE : subjects->nelts - i * MINT_CHUNK_SIZE;
+    chunk->status = APR_ENOMEM;
+  }
+  for(i = 0; i < batch->count && i < batch->window; i++){
+    mint_chunk_queue(batch, i);
+  }
+
+  ap_set_content_type(r, "application/x-ndjson");
+
+  apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  apr_status_t sent = APR_SUCCESS;
+  int status = OK;
+  for(i = 0; i < batch->count; i++){
+    mint_chunk *chunk = &batch->chunks[i];
+    int j;
+
+#if APR_HAS_THREADS
+    if(chunk->queued){
+      apr_thread_mutex_lock(batch->mutex);
+      while(!chunk->done){
+        apr_thread_cond_wait(batch->cond, batch->mutex);
+      }
+      apr_thread_mutex_unlock(batch->mutex);
+    }
+#endif
+    if(!chunk->done){
+      mint_chunk_sign(chunk);
+    }
+
+    if(chunk->status != APR_SUCCESS){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, chunk->status, r, APLOGNO(01810)
+                    "Cannot sign tokens of subjects %d to %d", i * MINT_CHUNK_SIZE, i * MINT_CHUNK_SIZE + chunk->count - 1);
+      status = HTTP_INTERNAL_SERVER_ERROR;
+    }else if(sent == APR_SUCCESS && status == OK){
+      for(j = 0; j < chunk->count; j++){
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(chunk->lines[j], chunk->lens[j], r->connection->bucket_alloc));
+      }
+      /* transient buckets are set aside by filters keeping them, before the pool is gone */
+      sent = ap_pass_brigade(r->output_filters, bb);
+      apr_brigade_cleanup(bb);
+    }
+    if(chunk->pool){
+      apr_pool_destroy(chunk->pool);
+    }
+    if(i + batch->window < batch->count){
+      mint_chunk_queue(batch, i + batch->window);
+    }
+  }
+
+  if(sent != APR_SUCCESS){
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, sent, r, APLOGNO(01810)
+                  "Cannot send minted tokens");
+    return AP_FILTER_ERROR;
+  }
+  return status;
+}
+
+/* Reads the body, one subject per line */
+static int mint_read_subjects(request_rec *r, apr_array_header_t **subjects){
+  apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  char *body = apr_palloc(r->pool, MINT_BODY_SIZE + 1);
+  apr_size_t len = 0;
+  int seen_eos = 0;
+
+  while(!seen_eos){
+    apr_bucket *bucket;
+    apr_status_t rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, HUGE_STRING_LEN);
+    if(rv != APR_SUCCESS){
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01810)
+                    "Cannot read subjects");
+      return ap_map_http_request_error(rv, HTTP_BAD_REQUEST);
+    }
+    for(bucket = APR_BRIGADE_FIRST(bb); bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)){
+      const char *data;
+      apr_size_t size;
+
+      if(APR_BUCKET_IS_EOS(bucket)){
+        seen_eos = 1;
+        break;
+      }
+      if(APR_BUCKET_IS_METADATA(bucket)){
+        continue;
+      }
+      if(apr_bucket_read(bucket, &data, &size, APR_BLOCK_READ) != APR_SUCCESS){
+        return HTTP_BAD_REQUEST;
+      }
+      if(len + size > MINT_BODY_SIZE){
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+      }
+      memcpy(body + len, data, size);
+      len += size;
+    }
+    apr_brigade_cleanup(bb);
+  }
+  body[len] = 0;
+
+  *subjects = apr_array_make(r->pool, 64, sizeof(char *));
+  char *last;
+  char *line = apr_strtok(body, "\r\n", &last);
+  while(line){
+    *(char **)apr_array_push(*subjects) = line;
+    line = apr_strtok(NULL, "\r\n", &last);
+  }
+  if(apr_is_empty_array(*subjects)){
+    return HTTP_BAD_REQUEST;
+  }
+  return OK;
+}
+
+/* Chunks which cannot be queued are signed on the request thread when their turn comes */
+static void mint_chunk_queue(mint_batch *batch, int index){
+  mint_chunk *chunk = &batch->chunks[index];
+
+  if(apr_pool_create_unmanaged_ex(&chunk->pool, NULL, NULL) != APR_SUCCESS){
+    chunk->pool = NULL;
+    chunk->done = 1;
+    return;
+  }
+#if APR_HAS_THREADS
+  if(mint_pool && apr_thread_pool_push(mint_pool, mint_chunk_run, chunk, APR_THREAD_TASK_PRIORITY_NORMAL, NULL) == APR_SUCCESS){
+    chunk->queued = 1;
+  }
+#endif
+}
+
+static void mint_chunk_sign(mint_chunk *chunk){
+  apr_status_t status = APR_SUCCESS;
+  char **lines = NULL;
+  apr_size_t *lens = NULL;
+  int i;
+
+  if(chunk->pool){
+    lines = apr_palloc(chunk->pool, chunk->count * sizeof(char *));
+    lens = apr_palloc(chunk->pool, chunk->count * sizeof(apr_size_t));
+    for(i = 0; i < chunk->count && status == APR_SUCCESS; i++){
+      const char *prefix = apr_pstrcat(chunk->pool, "{\"user\":\"", json_escape(chunk->pool, chunk->subjects[i]),
+                                       "\",\"token\":\"", NULL);
+      status = token_sign(chunk->pool, chunk->tpl, chunk->subjects[i], 0, prefix, "\"}\n", &lines[i], &lens[i]);
+    }
+  }else{
+    status = APR_ENOMEM;
+  }
+
+#if APR_HAS_THREADS
+  if(chunk->batch->mutex){
+    apr_thread_mutex_lock(chunk->batch->mutex);
+  }
+#endif
+  chunk->lines = lines;
+  chunk->lens = lens;
+  chunk->status = status;
+  chunk->done = 1;
+#if APR_HAS_THREADS
+  if(chunk->batch->mutex){
+    apr_thread_cond_broadcast(chunk->batch->cond);
+    apr_thread_mutex_unlock(chunk->batch->mutex);
+  }
+#endif
+}
+
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC mint_chunk_run(apr_thread_t *thread, void *data){
+  mint_chunk_sign((mint_chunk *)data);
+  return NULL;
+}
+#endif
+
+/*
+Revokes the token given in the Authorization header until it expires. The
+token must be valid, and must carry a jti as those delivered by this module.
+*/
+static int auth_jwt_logout_handler(request_rec *r){
+
+  if(!r->handler || strcmp(r->handler, JWT_LOGOUT_HANDLER)){
+    return DECLINED;
+  }
+
+  if(r->method_number != M_POST){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01811)
+          "the " JWT_LOGOUT_HANDLER " only supports the POST method for %s",
+                      r->uri);
+    return HTTP_METHOD_NOT_ALLOWED;
+  }
+
+  char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
+  if(signature_secret == NULL){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                  "You must specify AuthJWTSignatureSecret directive in configuration");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  const char* authorization_header = apr_table_get(r->headers_in, "Authorization");
+  if(!authorization_header || strncmp(authorization_header, "Bearer ", 7) || !authorization_header[7]){
+    return HTTP_BAD_REQUEST;
+  }
+
+  jwt_t* token = NULL;
+  int rv = token_check(r, &token, authorization_header + 7, (const unsigned char *)signature_secret);
+  if(token){
+    apr_pool_cleanup_register(r->pool, token, token_cleanup, apr_pool_cleanup_null);
+  }
+  if(rv != OK){
+    return rv;
+  }
+
+  const char* jti = token_get_claim(token, "jti");
+  if(!jti){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                  "Token has no jti, it cannot be revoked");
+    return HTTP_BAD_REQUEST;
+  }
+
+  apr_time_t exp = (apr_time_t)atoi(token_get_claim(token, "exp")) + get_leeway(r);
+  apr_status_t status = revocation_table_add(claim_hash(jti), exp);
+  if(status != APR_SUCCESS){
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01810)
+                  "Cannot revoke token %s, the revocation table is full or disabled", jti);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  /* the refresh token delivered along, if any, is revoked as well */
+  if(refresh_table.buckets && apr_table_get(r->headers_in, "Content-Type")){
+    static const char *fields[] = {"refresh_token"};
+    const char *refresh_token;
+    if(read_fields(r, fields, 1, &refresh_token) == OK){
+      refresh_table_remove(refresh_token);
+    }
+  }
+
+  ap_set_content_type(r, "application/json");
+  ap_rputs("{\"revoked\":true}", r);
+  return OK;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  CHILD TOKEN CACHE ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static void auth_jwt_child_init(apr_pool_t *p, server_rec *s){
+    auth_jwt_config_rec *sconf = (auth_jwt_config_rec *) ap_get_module_config(s->module_config,
+                                                    &auth_jwt_module);
+
+    random_child_init(p, s);
+
+    token_cache.pool = p;
+    token_cache.size = sconf->cache_size;
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&token_cache.mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "Cannot create token cache mutex, token cache disabled");
+        token_cache.size = 0;
+    }
+#endif
+    if(token_cache.size > 0){
+        token_cache.entries = apr_pcalloc(p, token_cache.size * sizeof(token_cache_entry));
+    }
+
+    token_templates.pool = p;
+    token_templates.templates = apr_hash_make(p);
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&token_templates.mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "Cannot create token templates mutex");
+        token_templates.templates = NULL;
+    }
+#endif
+
+    renew_cache.entries = apr_pcalloc(p, RENEW_CACHE_SIZE * sizeof(renew_cache_entry));
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&renew_cache.mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "Cannot create renewed tokens mutex, renewed tokens are not cached");
+        renew_cache.entries = NULL;
+    }
+#endif
+
+    remote_cache_child_init(p, s);
+    login_limiter_child_init(p, s);
+    revocation_table_child_init(p, s);
+    revocation_list_child_init(p, s);
+    user_invalidation_child_init(p, s);
+    refresh_table_child_init(p, s);
+    allowlist_child_init(p, s);
+    regex_child_init(p, s);
+
+#if APR_HAS_THREADS
+    if(providers_parallel_used && sconf->provider_threads > 0){
+        if(apr_thread_pool_create(&provider_pool, 0, sconf->provider_threads, p) != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                         "Cannot create provider thread pool, providers will be queried sequentially");
+            provider_pool = NULL;
+        }
+    }
+#endif
+#if APR_HAS_THREADS && defined(AP_MPMQ_CAN_SUSPEND)
+    if(sconf->login_threads > 0){
+        int can_suspend = 0;
+        if(ap_mpm_query(AP_MPMQ_CAN_SUSPEND, &can_suspend) != APR_SUCCESS || !can_suspend){
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(01810)
+                         "The MPM cannot suspend requests, AuthJWTLoginThreads ignored");
+        }else if(apr_thread_pool_create(&login_pool, 0, sconf->login_threads, p) != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                         "Cannot create login thread pool, logins will not be suspended");
+            login_pool = NULL;
+        }
+    }
+#endif
+#if APR_HAS_THREADS
+    if(sconf->mint_threads > 0
+       && apr_thread_pool_create(&mint_pool, 0, sconf->mint_threads, p) != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "Cannot create mint thread pool, bulk tokens will be signed on request threads");
+        mint_pool = NULL;
+    }
+#endif
+}
+
+static void token_cache_lock(void){
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(token_cache.mutex);
+#endif
+}
+
+static void token_cache_unlock(void){
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(token_cache.mutex);
+#endif
+}
+
+/*
+Returns OK with the cached user and exp, or DECLINED. In the latter case, when
+*flight is set the caller is in charge of verifying the token and must publish
+the outcome with token_cache_release, whatever it is.
+*/
+static int token_cache_acquire(request_rec *r, const unsigned char *digest, verified_token *vt, token_flight **flight){
+    token_cache_entry *entry;
+    token_flight *current;
+    int rv = DECLINED;
+
+    *flight = NULL;
+    if(token_cache.size <= 0){
+        return shared_cache_lookup(r, digest, vt);
+    }
+
+    token_cache_lock();
+
+    entry = &token_cache.entries[digest_hash(digest) % token_cache.size];
+    if(entry->valid && !memcmp(entry->digest, digest, TOKEN_DIGEST_SIZE)){
+        *vt = entry->token;
+        if(verified_token_check(r, vt) == OK){
+            token_cache_unlock();
+            return OK;
+        }
+        entry->valid = 0;
+    }
+
+    if(shared_cache_lookup(r, digest, vt) == OK){
+        memcpy(entry->digest, digest, TOKEN_DIGEST_SIZE);
+        entry->token = *vt;
+        entry->valid = 1;
+        token_cache_unlock();
+        return OK;
+    }
+
+    for(current = token_cache.flights; current; current = current->next){
+        if(!memcmp(current->digest, digest, TOKEN_DIGEST_SIZE)){
+            break;
+        }
+    }
+
+    if(current){
+        /* another thread is verifying this token, wait for its outcome */
+        current->waiters++;
+#if APR_HAS_THREADS
+        while(!current->done){
+            apr_thread_cond_wait(current->cond, token_cache.mutex);
+        }
+#endif
+        if(current->verified){
+            *vt = current->token;
+            rv = verified_token_check(r, vt);
+        }
+        if(--current->waiters == 0){
+            current->next = token_cache.free_flights;
+            token_cache.free_flights = current;
+        }
+        token_cache_unlock();
+        /* on failure the token is verified again to report the actual error */
+        return rv;
+    }
+
+    current = token_cache.free_flights;
+    if(current){
+        token_cache.free_flights = current->next;
+    }else{
+        current = apr_pcalloc(token_cache.pool, sizeof(*current));
+#if APR_HAS_THREADS
+        if(apr_thread_cond_create(&current->cond, token_cache.pool) != APR_SUCCESS){
+            token_cache_unlock();
+            return DECLINED;
+        }
+#endif
+    }
+    memcpy(current->digest, digest, TOKEN_DIGEST_SIZE);
+    current->done = 0;
+    current->waiters = 0;
+    current->verified = 0;
+    current->next = token_cache.flights;
+    token_cache.flights = current;
+    *flight = current;
+
+    token_cache_unlock();
+    return DECLINED;
+}
+
+/* Publishes the outcome of a verification, vt is NULL if it failed */
+static void token_cache_release(const unsigned char *digest, token_flight *flight, const verified_token *vt){
+    token_flight **link;
+
+    if(vt){
+        shared_cache_store(digest, vt);
+    }
+
+    if(!flight){
+        return;
+    }
+
+    token_cache_lock();
+
+    for(link = &token_cache.flights; *link; link = &(*link)->next){
+        if(*link == flight){
+            *link = flight->next;
+            break;
+        }
+    }
+
+    if(vt){
+        token_cache_entry *entry = &token_cache.entries[digest_hash(flight->digest) % token_cache.size];
+        memcpy(entry->digest, flight->digest, TOKEN_DIGEST_SIZE);
+        entry->token = *vt;
+        entry->valid = 1;
+
+        flight->token = *vt;
+        flight->verified = 1;
+    }
+
+    flight->done = 1;
+    if(flight->waiters){
+#if APR_HAS_THREADS
+        apr_thread_cond_broadcast(flight->cond);
+#endif
+    }else{
+        flight->next = token_cache.free_flights;
+        token_cache.free_flights = flight;
+    }
+
+    token_cache_unlock();
+}
+
+
+static int check_key_length(request_rec *r, const char* key, const char* algorithm){
+    int key_len = (int)strlen(key);
+    if(!strcmp(algorithm, "HS512")){
+        if(key_len!=64){
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                "The secret length must be 64 with HMAC SHA512 algorithm");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }else if(!strcmp(algorithm, "HS384")){
+        if(key_len!=32){
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                "The secret length must be 48 with HMAC SHA384 algorithm (current length is %d)", key_len);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }else if(!strcmp(algorithm, "HS256")){
+        if(key_len!=32){
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                "The secret length must be 32 with HMAC SHA256 algorithm (current length is %d)", key_len);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    else{
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+        "The only supported algorithms are HS256 (HMAC SHA256), HS384 (HMAC SHA384), and HS515 (HMAC SHA512)");
+        return 2;
+    }
+    return OK;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  AUTHORIZATION ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static const char *jwt_claim_parse(cmd_parms *cmd, const char *require_line, const void **parsed){
+    claim_matcher *matcher = apr_pcalloc(cmd->pool, sizeof(claim_matcher));
+    apr_array_header_t *values = apr_array_make(cmd->pool, 4, sizeof(claim_match_value));
+    const char *line = require_line;
+
+    matcher->claim = ap_getword_conf(cmd->pool, &line);
+    while(*line){
+        claim_match_value *value;
+        char *word = ap_getword_conf(cmd->pool, &line);
+        apr_ssize_t len = APR_HASH_KEY_STRING;
+        if(!*word){
+            break;
+        }
+        value = (claim_match_value *)apr_array_push(values);
+        value->value = word;
+        value->hash = apr_hashfunc_default(word, &len);
+    }
+    if(!*matcher->claim || values->nelts == 0){
+        return "Require jwt-claim takes a claim name and at least one value";
+    }
+
+    matcher->count = values->nelts;
+    matcher->values = (claim_match_value *)values->elts;
+    *parsed = matcher;
+    return NULL;
+}
+
+/* Granted if the claim, or one of the elements of an array claim, is one of the values */
+static authz_status jwt_claim_check(request_rec *r, const char *require_line, const void *parsed){
+    const claim_matcher *matcher = (const claim_matcher *)parsed;
+    const claim_view *view;
+    int i;
+
+    if(!r->user){
+        return AUTHZ_DENIED_NO_USER;
+    }
+
+    if(!request_token(r)){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Require jwt-claim needs AuthType jwt: %s", r->uri);
+        return AUTHZ_DENIED;
+    }
+
+    view = request_claim(r, matcher->claim);
+    for(i = 0; view && i < matcher->count; i++){
+        if(claim_view_contains(view, matcher->values[i].value, matcher->values[i].hash)){
+            return AUTHZ_GRANTED;
+        }
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(01810)
+                  "Claim %s of %s does not match: %s", matcher->claim, r->user, r->uri);
+    return AUTHZ_DENIED;
+}
+
+/*
+The token authenticating the request. It is decoded by token_check, but not when
+it was found in a cache, whose records keep no claims but the user and the
+timestamps: it is then decoded, and its signature checked, once for all the
+requirements of the request.
+*/
+static jwt_t *request_token(request_rec *r){
+    const auth_jwt_request_rec *rconf = (auth_jwt_request_rec *) ap_get_module_config(r->request_config,
+                                                    &auth_jwt_module);
+    auth_jwt_request_rec *decoded;
+    jwt_t *token = NULL;
+
+    if(!rconf){
+        return NULL;
+    }
+    if(rconf->token){
+        return rconf->token;
+    }
+    if(!rconf->signature_secret || strncmp(rconf->authorization, "Bearer ", 7)){
+        return NULL;
+    }
+    if(jwt_decode(&token, rconf->authorization + 7, (const unsigned char *)rconf->signature_secret,
+                  strlen(rconf->signature_secret)) != 0 || !token){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Cannot decode token of %s", r->user);
+        return NULL;
+    }
+    apr_pool_cleanup_register(r->pool, token, token_cleanup, apr_pool_cleanup_null);
+
+    /* the record may belong to the main request */
+    decoded = apr_pmemdup(r->pool, rconf, sizeof(auth_jwt_request_rec));
+    decoded->token = token;
+    ap_set_module_config(r->request_config, &auth_jwt_module, decoded);
+    return token;
+}
+
+static const char *jwt_scope_parse(cmd_parms *cmd, const char *require_line, const void **parsed){
+    return mask_matcher_parse(cmd, require_line, parsed, &scope_bits);
+}
+
+static const char *jwt_role_parse(cmd_parms *cmd, const char *require_line, const void **parsed){
+    return mask_matcher_parse(cmd, require_line, parsed, &role_bits);
+}
+
+/*
+Require lines of .htaccess files are parsed per request, from r->pool and by
+several threads at once: they must not touch state shared by the whole server.
+*/
+static int reading_server_config(cmd_parms *cmd){
+    return cmd->pool == cmd->server->process->pconf;
+}
+
+/*
+[any|all] <name>...: interns the names and compiles them into a mask. Names are
+only interned while the server configuration is read, .htaccess files can only
+use names the server configuration already requires.
+*/
+static const char *mask_matcher_parse(cmd_parms *cmd, const char *require_line, const void **parsed, claim_bits *bits){
+    mask_matcher *matcher = apr_pcalloc(cmd->pool, sizeof(mask_matcher));
+    const char *line = require_line;
+    int first = 1;
+
+    matcher->bits = bits;
+    while(*line){
+        char *word = ap_getword_conf(cmd->pool, &line);
+        void *bit;
+        if(!*word){
+            break;
+        }
+        if(first && (!strcasecmp(word, "any") || !strcasecmp(word, "all"))){
+            matcher->all = !strcasecmp(word, "all");
+            first = 0;
+            continue;
+        }
+        first = 0;
+
+        bit = apr_hash_get(bits->names, word, APR_HASH_KEY_STRING);
+        if(!bit){
+            if(!reading_server_config(cmd)){
+                return apr_psprintf(cmd->pool, "%s %s must also be required in the server configuration to be used in .htaccess files",
+                                    bits->claim, word);
+            }
+            if(bits->count == CLAIM_BITS_MAX){
+                return apr_psprintf(cmd->pool, "At most %d distinct %s names can be required", CLAIM_BITS_MAX, bits->claim);
+            }
+            /* stored off by one, NULL stands for "not interned" */
+            bit = (void *)(apr_uintptr_t)(++bits->count);
+            apr_hash_set(bits->names, apr_pstrdup(apr_hash_pool_get(bits->names), word), APR_HASH_KEY_STRING, bit);
+        }
+        matcher->mask |= APR_UINT64_C(1) << ((apr_uintptr_t)bit - 1);
+    }
+    if(!matcher->mask){
+        return apr_psprintf(cmd->pool, "Require jwt-%s takes at least one name", bits == &scope_bits ? "scope" : "role");
+    }
+    *parsed = matcher;
+    return NULL;
+}
+
+static authz_status jwt_mask_check(request_rec *r, const char *require_line, const void *parsed){
+    const mask_matcher *matcher = (const mask_matcher *)parsed;
+    const auth_jwt_request_rec *rconf;
+    apr_uint64_t mask;
+
+    if(!r->user){
+        return AUTHZ_DENIED_NO_USER;
+    }
+
+    rconf = request_masks(r);
+    if(!rconf){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Require jwt-scope and jwt-role need AuthType jwt: %s", r->uri);
+        return AUTHZ_DENIED;
+    }
+
+    mask = matcher->bits == &scope_bits ? rconf->scope_mask : rconf->role_mask;
+    if(matcher->all ? (mask & matcher->mask) == matcher->mask : (mask & matcher->mask) != 0){
+        return AUTHZ_GRANTED;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(01810)
+                  "%s of %s do not match \"%s\": %s", matcher->bits->claim, r->user, require_line, r->uri);
+    return AUTHZ_DENIED;
+}
+
+/* The request record with the scope and role masks of its token, computed once */
+static const auth_jwt_request_rec *request_masks(request_rec *r){
+    const auth_jwt_request_rec *rconf = (auth_jwt_request_rec *) ap_get_module_config(r->request_config,
+                                                    &auth_jwt_module);
+    auth_jwt_request_rec *masked;
+    apr_uint64_t scope_mask, role_mask;
+
+    if(rconf && rconf->masks_set){
+        return rconf;
+    }
+    if(!request_token(r)){
+        return NULL;
+    }
+    scope_mask = scope_bits.count ? claim_mask(request_claim(r, scope_bits.claim), &scope_bits) : 0;
+    role_mask = role_bits.count ? claim_mask(request_claim(r, role_bits.claim), &role_bits) : 0;
+
+    /* request_token and request_claim may have replaced the record */
+    rconf = (auth_jwt_request_rec *) ap_get_module_config(r->request_config, &auth_jwt_module);
+    masked = apr_pmemdup(r->pool, rconf, sizeof(auth_jwt_request_rec));
+    masked->scope_mask = scope_mask;
+    masked->role_mask = role_mask;
+    masked->masks_set = 1;
+    ap_set_module_config(r->request_config, &auth_jwt_module, masked);
+    return masked;
+}
+
+/* Names of a space-delimited string claim, or of an array claim, as a mask */
+static apr_uint64_t claim_mask(const claim_view *view, const claim_bits *bits){
+    apr_uint64_t mask = 0;
+    int i;
+
+    for(i = 0; view && i < view->count; i++){
+        const char *names = view->values[i];
+        while(*names){
+            const char *end = names;
+            void *bit;
+            while(*end && *end != ' '){
+                end++;
+            }
+            if(end > names){
+                bit = apr_hash_get(bits->names, names, end - names);
+                if(bit){
+                    mask |= APR_UINT64_C(1) << ((apr_uintptr_t)bit - 1);
+                }
+            }
+            names = *end ? end + 1 : end;
+        }
+    }
+    return mask;
+}
+
+/* The view of a claim of the request token, NULL if it is missing or not supported */
+static const claim_view *request_claim(request_rec *r, const char *claim){
+    const auth_jwt_request_rec *rconf = (auth_jwt_request_rec *) ap_get_module_config(r->request_config,
+                                                    &auth_jwt_module);
+    auth_jwt_request_rec *owned;
+    apr_array_header_t *values;
+    claim_view *view;
+
+    if(!rconf || !rconf->token){
+        return NULL;
+    }
+    /* views are allocated from the pool of the request which built them */
+    if(rconf->claims_owner != r){
+        owned = apr_pmemdup(r->pool, rconf, sizeof(auth_jwt_request_rec));
+        owned->claims_owner = r;
+        owned->claims = apr_hash_make(r->pool);
+        ap_set_module_config(r->request_config, &auth_jwt_module, owned);
+        rconf = owned;
+    }
+
+    view = apr_hash_get(rconf->claims, claim, APR_HASH_KEY_STRING);
+    if(!view){
+        values = claim_values(r->pool, rconf->token, claim);
+        if(!values){
+            return NULL;
+        }
+        view = claim_view_make(r->pool, values);
+        apr_hash_set(rconf->claims, claim, APR_HASH_KEY_STRING, view);
+    }
+    return view;
+}
+
+static claim_view *claim_view_make(apr_pool_t *p, apr_array_header_t *values){
+    claim_view *view = apr_pcalloc(p, sizeof(claim_view));
+    apr_uint32_t size = 8;
+    int i;
+
+    view->count = values->nelts;
+    view->values = (const char **)values->elts;
+    view->hashes = apr_palloc(p, (values->nelts + 1) * sizeof(unsigned int));
+    /* at most half full */
+    while(size < (apr_uint32_t)values->nelts * 2){
+        size <<= 1;
+    }
+    view->table = apr_pcalloc(p, size * sizeof(apr_uint32_t));
+    view->mask = size - 1;
+
+    for(i = 0; i < view->count; i++){
+        apr_ssize_t len = APR_HASH_KEY_STRING;
+        apr_uint32_t slot;
+        view->hashes[i] = apr_hashfunc_default(view->values[i], &len);
+        for(slot = view->hashes[i] & view->mask; view->table[slot]; slot = (slot + 1) & view->mask);
+        view->table[slot] = (apr_uint32_t)i + 1;
+    }
+    return view;
+}
+
+/* hash is apr_hashfunc_default of value */
+static int claim_view_contains(const claim_view *view, const char *value, unsigned int hash){
+    apr_uint32_t slot;
+
+    for(slot = hash & view->mask; view->table[slot]; slot = (slot + 1) & view->mask){
+        apr_uint32_t i = view->table[slot] - 1;
+        if(view->hashes[i] == hash && !strcmp(view->values[i], value)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Values of a string, scalar or array claim, NULL if it is missing or not supported */
+static apr_array_header_t *claim_values(apr_pool_t *p, jwt_t *token, const char *claim){
+    apr_array_header_t *values = apr_array_make(p, 4, sizeof(const char *));
+    const char *value = token_get_claim(token, claim);
+    char *json;
+    int rv;
+
+    if(value){
+        APR_ARRAY_PUSH(values, const char *) = value;
+        return values;
+    }
+
+    json = jwt_get_grants_json(token, claim);
+    if(!json){
+        return NULL;
+    }
+    rv = json_claim_values(p, json, values);
+    free(json);
+    return rv == OK ? values : NULL;
+}
+
+/* Parses a JSON scalar, or a flat array of scalars */
+static int json_claim_values(apr_pool_t *p, const char *json, apr_array_header_t *values){
+    const char *c = json;
+    int in_array = 0;
+
+    while(apr_isspace(*c)) c++;
+    if(*c == '['){
+        in_array = 1;
+        c++;
+    }
+    for(;;){
+        while(apr_isspace(*c)) c++;
+        if(in_array && *c == ']' && values->nelts == 0){
+            c++;
+            break;
+        }
+        if(*c == '"'){
+            const char *value = json_unescape(p, &c);
+            if(!value){
+                return DECLINED;
+            }
+            APR_ARRAY_PUSH(values, const char *) = value;
+        }else{
+            const char *start = c;
+            while(*c && *c != ',' && *c != ']' && !apr_isspace(*c)){
+                if(*c == '{' || *c == '[' || *c == '"'){
+                    return DECLINED;
+                }
+                c++;
+            }
+            if(c == start){
+                return DECLINED;
+            }
+            APR_ARRAY_PUSH(values, const char *) = apr_pstrndup(p, start, c - start);
+        }
+        while(apr_isspace(*c)) c++;
+        if(!in_array){
+            break;
+        }
+        if(*c == ','){
+            c++;
+        }else if(*c == ']'){
+            c++;
+            break;
+        }else{
+            return DECLINED;
+        }
+    }
+    while(apr_isspace(*c)) c++;
+    return *c ? DECLINED : OK;
+}
+
+/* Unescapes the JSON string *json points to, and moves past it */
+static const char *json_unescape(apr_pool_t *p, const char **json){
+    const char *c = *json + 1;
+    const char *end = c;
+    char *value, *out;
+
+    /* sized to the string, not to the rest of a large array */
+    while(*end && *end != '"'){
+        end += (*end == '\\' && end[1]) ? 2 : 1;
+    }
+    value = apr_palloc(p, end - c + 1);
+    out = value;
+
+    while(*c != '"'){
+        unsigned int cp;
+        if(!*c){
+            return NULL;
+        }
+        if(*c != '\\'){
+            *out++ = *c++;
+            continue;
+        }
+        c++;
+        switch(*c++){
+        case '"': *out++ = '"'; continue;
+        case '\\': *out++ = '\\'; continue;
+        case '/': *out++ = '/'; continue;
+        case 'b': *out++ = '\b'; continue;
+        case 'f': *out++ = '\f'; continue;
+        case 'n': *out++ = '\n'; continue;
+        case 'r': *out++ = '\r'; continue;
+        case 't': *out++ = '\t'; continue;
+        case 'u': break;
+        default: return NULL;
+        }
+        if(!apr_isxdigit(c[0]) || !apr_isxdigit(c[1]) || !apr_isxdigit(c[2]) || !apr_isxdigit(c[3])){
+            return NULL;
+        }
+        cp = (unsigned int)strtoul(apr_pstrndup(p, c, 4), NULL, 16);
+        c += 4;
+        if(cp >= 0xd800 && cp < 0xdc00){
+            unsigned int low;
+            if(c[0] != '\\' || c[1] != 'u' || !apr_isxdigit(c[2]) || !apr_isxdigit(c[3])
+               || !apr_isxdigit(c[4]) || !apr_isxdigit(c[5])){
+                return NULL;
+            }
+            low = (unsigned int)strtoul(apr_pstrndup(p, c + 2, 4), NULL, 16);
+            if(low < 0xdc00 || low >= 0xe000){
+                return NULL;
+            }
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            c += 6;
+        }else if(cp >= 0xdc00 && cp < 0xe000){
+            return NULL;
+        }
+        if(cp == 0){
+            return NULL;
+        }else if(cp < 0x80){
+            *out++ = (char)cp;
+        }else if(cp < 0x800){
+            *out++ = (char)(0xc0 | (cp >> 6));
+            *out++ = (char)(0x80 | (cp & 0x3f));
+        }else if(cp < 0x10000){
+            *out++ = (char)(0xe0 | (cp >> 12));
+            *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+            *out++ = (char)(0x80 | (cp & 0x3f));
+        }else{
+            *out++ = (char)(0xf0 | (cp >> 18));
+            *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+            *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+            *out++ = (char)(0x80 | (cp & 0x3f));
+        }
+    }
+    *out = 0;
+    *json = c + 1;
+    return value;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  CLAIM ALLOWLISTS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
+
+static const char *jwt_claim_in_parse(cmd_parms *cmd, const char *require_line, const void **parsed){
+    allowlist_matcher *matcher = apr_pcalloc(cmd->pool, sizeof(allowlist_matcher));
+    const char *line = require_line;
+    const char *source;
+    char *word;
+    claim_allowlist *list;
+
+    matcher->claim = ap_getword_conf(cmd->pool, &line);
+    word = ap_getword_conf(cmd->pool, &line);
+    if(!*matcher->claim || strncmp(word, "file:", 5) || *line){
+        return "Require jwt-claim-in takes a claim name and file:<path>";
+    }
+    source = ap_server_root_relative(cmd->pool, word + 5);
+    if(!source){
+        return apr_pstrcat(cmd->pool, "Invalid allowlist path ", word + 5, NULL);
+    }
+
+    /* requirements on the same file share its compiled list, which outlives .htaccess files */
+    list = apr_hash_get(allowlists, source, APR_HASH_KEY_STRING);
+    if(!list){
+        if(!reading_server_config(cmd)){
+            return apr_pstrcat(cmd->pool, "Allowlist ", source,
+                               " must also be required in the server configuration to be used in .htaccess files", NULL);
+        }
+        list = apr_pcalloc(cmd->pool, sizeof(claim_allowlist));
+        list->path = source;
+        list->compiled = ap_runtime_dir_relative(cmd->pool,
+                            apr_psprintf(cmd->pool, "authnz_jwt_allowlist.%016" APR_UINT64_T_HEX_FMT, claim_hash(source)));
+        apr_hash_set(allowlists, list->path, APR_HASH_KEY_STRING, list);
+    }
+    matcher->list = list;
+    *parsed = matcher;
+    return NULL;
+}
+
+/* Granted if the claim, or one of the elements of an array claim, is in the list */
+static authz_status jwt_claim_in_check(request_rec *r, const char *require_line, const void *parsed){
+    const allowlist_matcher *matcher = (const allowlist_matcher *)parsed;
+    const claim_view *view;
+    int i;
+
+    if(!r->user){
+        return AUTHZ_DENIED_NO_USER;
+    }
+
+    if(!request_token(r)){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Require jwt-claim-in needs AuthType jwt: %s", r->uri);
+        return AUTHZ_DENIED;
+    }
+
+    allowlist_refresh(r, matcher->list);
+    view = request_claim(r, matcher->claim);
+    for(i = 0; view && i < view->count; i++){
+        if(allowlist_contains(matcher->list, view->values[i])){
+            return AUTHZ_GRANTED;
+        }
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(01810)
+                  "Claim %s of %s is not in %s: %s", matcher->claim, r->user, matcher->list->path, r->uri);
+    return AUTHZ_DENIED;
+}
+
+/* Compiles the lists whose compiled file is missing or out of date */
+static apr_status_t allowlist_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s){
+    apr_hash_index_t *index;
+    apr_status_t rv;
+
+    rv = ap_global_mutex_create(&allowlist_mutex, NULL, ALLOWLIST_MUTEX_TYPE, NULL, s, pconf, 0);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+
+    for(index = apr_hash_first(ptemp, allowlists); index; index = apr_hash_next(index)){
+        claim_allowlist *list;
+        apr_finfo_t finfo;
+        apr_time_t compiled;
+        void *value;
+
+        apr_hash_this(index, NULL, NULL, &value);
+        list = (claim_allowlist *)value;
+        rv = apr_stat(&finfo, list->path, APR_FINFO_MTIME, ptemp);
+        if(rv == APR_SUCCESS
+           && (allowlist_compiled_mtime(ptemp, list, &compiled) != APR_SUCCESS || compiled != finfo.mtime)){
+            rv = allowlist_compile(ptemp, list, finfo.mtime);
+        }
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot compile allowlist %s", list->path);
+            return rv;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static void allowlist_child_init(apr_pool_t *p, server_rec *s){
+    apr_hash_index_t *index;
+
+    if(!allowlist_mutex){
+        return;
+    }
+    apr_global_mutex_child_init(&allowlist_mutex, apr_global_mutex_lockfile(allowlist_mutex), p);
+    allowlist_pool = p;
+
+    for(index = apr_hash_first(p, allowlists); index; index = apr_hash_next(index)){
+        claim_allowlist *list;
+        apr_status_t rv;
+        void *value;
+
+        apr_hash_this(index, NULL, NULL, &value);
+        list = (claim_allowlist *)value;
+#if APR_HAS_THREADS
+        rv = apr_thread_rwlock_create(&list->lock, p);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot create lock of allowlist %s, it is considered empty", list->path);
+            continue;
+        }
+#endif
+        rv = allowlist_map(list);
+        if(rv != APR_SUCCESS){
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                         "Cannot map compiled allowlist %s", list->compiled);
+        }
+    }
+}
+
+static apr_uint32_t allowlist_slot(apr_uint64_t hash, apr_uint32_t displacement, apr_uint32_t count){
+    apr_uint64_t x = hash ^ (displacement * APR_UINT64_C(0x9E3779B97F4A7C15));
+    x ^= x >> 33;
+    x *= APR_UINT64_C(0xFF51AFD7ED558CCD);
+    x ^= x >> 33;
+    x *= APR_UINT64_C(0xC4CEB9FE1A85EC53);
+    x ^= x >> 33;
+    return (apr_uint32_t)(x % count);
+}
+
+#define ALLOWLIST_DISPLACEMENTS(header) ((const apr_int32_t *)((const char *)(header) + APR_ALIGN_DEFAULT(sizeof(allowlist_header))))
+#define ALLOWLIST_FINGERPRINTS_OFFSET(count) (APR_ALIGN_DEFAULT(sizeof(allowlist_header)) + APR_ALIGN_DEFAULT((apr_size_t)(count) * sizeof(apr_int32_t)))
+#define ALLOWLIST_OFFSETS_OFFSET(count) (ALLOWLIST_FINGERPRINTS_OFFSET(count) + (apr_size_t)(count) * sizeof(apr_uint64_t))
+#define ALLOWLIST_VALUES_OFFSET(count) (ALLOWLIST_OFFSETS_OFFSET(count) + APR_ALIGN_DEFAULT((apr_size_t)(count) * sizeof(apr_uint32_t)))
+
+static int compare_allowlist_value(const void *a, const void *b){
+    return compare_jti(&((const allowlist_value *)a)->hash, &((const allowlist_value *)b)->hash);
+}
+
+/*
+Hash and displace: values fall into as many buckets as there are values. The
+largest buckets are placed first, each with the first displacement which sends
+all of its values to free slots. Buckets of a single value then take the
+remaining free slots, their displacement stores the slot as -(slot + 1).
+*/
+static apr_status_t allowlist_compile(apr_pool_t *p, claim_allowlist *list, apr_time_t mtime){
+    apr_array_header_t *entries = apr_array_make(p, 1024, sizeof(allowlist_value));
+    allowlist_value *sorted;
+    apr_uint64_t *keys, *fingerprints;
+    apr_uint32_t *starts, *order, *slots, *offsets;
+    apr_int32_t *displacements;
+    const char **key_values, **slot_values = NULL;
+    char *used, *values;
+    allowlist_header *header;
+    apr_uint32_t count = 0, free_slot = 0, max_size = 0, b, i, k, n;
+    apr_size_t size, values_size = 0;
+    apr_file_t *file;
+    char *temp;
+    char line[HUGE_STRING_LEN];
+    apr_status_t rv;
+    int j;
+
+    rv = apr_file_open(&file, list->path, APR_READ, APR_OS_DEFAULT, p);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    while(apr_file_gets(line, sizeof(line), file) == APR_SUCCESS){
+        char *value = line;
+        char *end;
+        while(apr_isspace(*value)){
+            value++;
+        }
+        end = value + strlen(value);
+        while(end > value && apr_isspace(end[-1])){
+            *--end = 0;
+        }
+        if(!*value || *value == '#'){
+            continue;
+        }
+        allowlist_value *entry = (allowlist_value *)apr_array_push(entries);
+        entry->hash = claim_hash(value);
+        entry->value = apr_pstrdup(p, value);
+    }
+    apr_file_close(file);
+
+    sorted = (allowlist_value *)entries->elts;
+    qsort(sorted, entries->nelts, sizeof(allowlist_value), compare_allowlist_value);
+    for(j=0;j<entries->nelts;j++){
+        if(!j || sorted[j].hash != sorted[j-1].hash){
+            values_size += strlen(sorted[j].value) + 1;
+            sorted[count++] = sorted[j];
+        }else if(strcmp(sorted[j].value, sorted[j-1].value)){
+            ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, p, APLOGNO(01810)
+                          "Values %s and %s of allowlist %s have the same hash, %s is ignored",
+                          sorted[j-1].value, sorted[j].value, list->path, sorted[j].value);
+        }
+    }
+
+    size = ALLOWLIST_VALUES_OFFSET(count) + values_size;
+    header = apr_pcalloc(p, size);
+    memcpy(header->magic, ALLOWLIST_MAGIC, sizeof(header->magic));
+    header->version = ALLOWLIST_VERSION;
+    header->count = count;
+    header->mtime = mtime;
+    displacements = (apr_int32_t *)ALLOWLIST_DISPLACEMENTS(header);
+    fingerprints = (apr_uint64_t *)((char *)header + ALLOWLIST_FINGERPRINTS_OFFSET(count));
+    offsets = (apr_uint32_t *)((char *)header + ALLOWLIST_OFFSETS_OFFSET(count));
+    values = (char *)header + ALLOWLIST_VALUES_OFFSET(count);
+
+    if(count > 0){
+        apr_uint32_t *by_size;
+
+        /* values grouped by bucket, buckets sorted by decreasing size */
+        starts = apr_pcalloc(p, (count + 1) * sizeof(apr_uint32_t));
+        keys = apr_palloc(p, count * sizeof(apr_uint64_t));
+        key_values = apr_palloc(p, count * sizeof(const char *));
+        slot_values = apr_palloc(p, count * sizeof(const char *));
+        order = apr_palloc(p, count * sizeof(apr_uint32_t));
+        used = apr_pcalloc(p, count);
+        for(i=0;i<count;i++){
+            starts[sorted[i].hash % count + 1]++;
+        }
+        for(b=0;b<count;b++){
+            if(starts[b + 1] > max_size){
+                max_size = starts[b + 1];
+            }
+            starts[b + 1] += starts[b];
+        }
+        slots = apr_pcalloc(p, count * sizeof(apr_uint32_t));
+        for(i=0;i<count;i++){
+            b = (apr_uint32_t)(sorted[i].hash % count);
+            key_values[starts[b] + slots[b]] = sorted[i].value;
+            keys[starts[b] + slots[b]++] = sorted[i].hash;
+        }
+        by_size = apr_pcalloc(p, (max_size + 2) * sizeof(apr_uint32_t));
+        for(b=0;b<count;b++){
+            by_size[max_size - (starts[b + 1] - starts[b]) + 1]++;
+        }
+        for(k=0;k<=max_size;k++){
+            by_size[k + 1] += by_size[k];
+        }
+        for(b=0;b<count;b++){
+            order[by_size[max_size - (starts[b + 1] - starts[b])]++] = b;
+        }
+
+        for(i=0;i<count;i++){
+            apr_uint32_t d;
+
+            b = order[i];
+            n = starts[b + 1] - starts[b];
+            if(n == 0){
+                break;
+            }
+            if(n == 1){
+                while(used[free_slot]){
+                    free_slot++;
+                }
+                used[free_slot] = 1;
+                displacements[b] = -(apr_int32_t)free_slot - 1;
+                fingerprints[free_slot] = keys[starts[b]];
+                slot_values[free_slot] = key_values[starts[b]];
+                continue;
+            }
+            for(d = 1; d < ALLOWLIST_MAX_DISPLACEMENT; d++){
+                for(k=0;k<n;k++){
+                    apr_uint32_t l;
+                    slots[k] = allowlist_slot(keys[starts[b] + k], d, count);
+                    if(used[slots[k]]){
+                        break;
+                    }
+                    for(l=0;l<k && slots[l] != slots[k];l++);
+                    if(l < k){
+                        break;
+                    }
+                }
+                if(k == n){
+                    break;
+                }
+            }
+            if(d == ALLOWLIST_MAX_DISPLACEMENT){
+                return APR_EGENERAL;
+            }
+            displacements[b] = (apr_int32_t)d;
+            for(k=0;k<n;k++){
+                used[slots[k]] = 1;
+                fingerprints[slots[k]] = keys[starts[b] + k];
+                slot_values[slots[k]] = key_values[starts[b] + k];
+            }
+        }
+
+        values_size = 0;
+        for(i=0;i<count;i++){
+            apr_size_t len = strlen(slot_values[i]) + 1;
+            offsets[i] = (apr_uint32_t)values_size;
+            memcpy(values + values_size, slot_values[i], len);
+            values_size += len;
+        }
+    }
+
+    /* written aside then renamed, children may be mapping the previous one */
+    temp = apr_pstrcat(p, list->compiled, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&file, temp, APR_CREATE | APR_WRITE | APR_EXCL | APR_BINARY, p);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    rv = apr_file_write_full(file, header, size, NULL);
+    apr_file_close(file);
+    if(rv == APR_SUCCESS){
+        rv = apr_file_rename(temp, list->compiled, p);
+    }
+    if(rv != APR_SUCCESS){
+        apr_file_remove(temp, p);
+        return rv;
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, 0, p, APLOGNO(01810)
+                  "Allowlist %s compiled with %u values", list->path, count);
+    return APR_SUCCESS;
+}
+
+/* mtime of the list the compiled file was made of */
+static apr_status_t allowlist_compiled_mtime(apr_pool_t *p, claim_allowlist *list, apr_time_t *mtime){
+    allowlist_header header;
+    apr_file_t *file;
+    apr_status_t rv;
+
+    rv = apr_file_open(&file, list->compiled, APR_READ | APR_BINARY, APR_OS_DEFAULT, p);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    rv = apr_file_read_full(file, &header, sizeof(header), NULL);
+    apr_file_close(file);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    if(memcmp(header.magic, ALLOWLIST_MAGIC, sizeof(header.magic)) || header.version != ALLOWLIST_VERSION){
+        return APR_EGENERAL;
+    }
+    *mtime = header.mtime;
+    return APR_SUCCESS;
+}
+
+/* Maps the compiled file in place of the current mapping of the child */
+static apr_status_t allowlist_map(claim_allowlist *list){
+    const allowlist_header *header;
+    apr_pool_t *pool, *previous;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mmap;
+    apr_status_t rv;
+
+    rv = apr_pool_create(&pool, allowlist_pool);
+    if(rv != APR_SUCCESS){
+        return rv;
+    }
+    rv = apr_file_open(&file, list->compiled, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool);
+    if(rv == APR_SUCCESS){
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+        if(rv == APR_SUCCESS && (apr_size_t)finfo.size < sizeof(allowlist_header)){
+            rv = APR_EGENERAL;
         }
-        else {
-            provider = current_provider->provider;
-            apr_table_setn(r->notes, AUTHN_PROVIDER_NAME_NOTE, current_provider->provider_name);
+        if(rv == APR_SUCCESS){
+            rv = apr_mmap_create(&mmap, file, 0, (apr_size_t)finfo.size, APR_MMAP_READ, pool);
         }
-
-        if (!username || !password) {
-            authn_result = AUTH_USER_NOT_FOUND;
-            break;
+        apr_file_close(file);
+    }
+    if(rv == APR_SUCCESS){
+        header = (const allowlist_header *)mmap->mm;
+        /* values must end with a NUL so that comparing them cannot run past the mapping */
+        if(memcmp(header->magic, ALLOWLIST_MAGIC, sizeof(header->magic)) || header->version != ALLOWLIST_VERSION
+           || (apr_size_t)finfo.size < ALLOWLIST_VALUES_OFFSET(header->count)
+           || (header->count > 0 && ((const char *)mmap->mm)[finfo.size - 1])){
+            rv = APR_EGENERAL;
         }
+    }
+    if(rv != APR_SUCCESS){
+        apr_pool_destroy(pool);
+        return rv;
+    }
 
-        authn_result = provider->check_password(r, username, password);
+#if APR_HAS_THREADS
+    apr_thread_rwlock_wrlock(list->lock);
+#endif
+    previous = list->pool;
+    list->pool = pool;
+    list->header = header;
+    list->displacements = ALLOWLIST_DISPLACEMENTS(header);
+    list->fingerprints = (const apr_uint64_t *)((const char *)header + ALLOWLIST_FINGERPRINTS_OFFSET(header->count));
+    list->offsets = (const apr_uint32_t *)((const char *)header + ALLOWLIST_OFFSETS_OFFSET(header->count));
+    list->values = (const char *)header + ALLOWLIST_VALUES_OFFSET(header->count);
+    list->values_size = (apr_size_t)finfo.size - ALLOWLIST_VALUES_OFFSET(header->count);
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(list->lock);
+#endif
+    if(previous){
+        apr_pool_destroy(previous);
+    }
+    return APR_SUCCESS;
+}
 
-        apr_table_unset(r->notes, AUTHN_PROVIDER_NAME_NOTE);
+static void allowlist_refresh(request_rec *r, claim_allowlist *list){
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(r->request_time);
+    apr_uint32_t last = apr_atomic_read32(&list->last_check);
+    apr_time_t mapped, compiled;
+    apr_finfo_t finfo;
 
-        if (authn_result != AUTH_USER_NOT_FOUND) {
-            break;
-        }
+    /* a single thread per child and per second looks at the file */
+    if(now == last || apr_atomic_cas32(&list->last_check, now, last) != last){
+        return;
+    }
+#if APR_HAS_THREADS
+    if(!list->lock){
+        return;
+    }
+    apr_thread_rwlock_rdlock(list->lock);
+#endif
+    mapped = list->header ? list->header->mtime : 0;
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(list->lock);
+#endif
+    if(apr_stat(&finfo, list->path, APR_FINFO_MTIME, r->pool) != APR_SUCCESS || finfo.mtime == mapped){
+        return;
+    }
 
-        if (!conf->providers) {
-            break;
+    /* another child is already compiling the new list */
+    if(apr_global_mutex_trylock(allowlist_mutex) != APR_SUCCESS){
+        return;
+    }
+    if(allowlist_compiled_mtime(r->pool, list, &compiled) != APR_SUCCESS || compiled != finfo.mtime){
+        apr_pool_t *p;
+        if(apr_pool_create(&p, r->pool) == APR_SUCCESS){
+            if(allowlist_compile(p, list, finfo.mtime) != APR_SUCCESS){
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                              "Cannot compile allowlist %s, the previous one is kept", list->path);
+            }
+            apr_pool_destroy(p);
         }
+    }
+    apr_global_mutex_unlock(allowlist_mutex);
 
-        current_provider = current_provider->next;
-    } while (current_provider);
+    if(allowlist_map(list) != APR_SUCCESS){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Cannot map compiled allowlist %s", list->compiled);
+    }
+}
 
-    if (authn_result != AUTH_GRANTED) {
-        int return_code;
+static int allowlist_contains(claim_allowlist *list, const char *value){
+    apr_uint64_t hash = claim_hash(value);
+    apr_uint32_t count, slot;
+    apr_int32_t displacement;
+    int found = 0;
 
-        /*if (authn_result != AUTH_DENIED) && !(conf->authoritative))
-            return DECLINED;
-        }*/
+#if APR_HAS_THREADS
+    if(!list->lock){
+        return 0;
+    }
+    apr_thread_rwlock_rdlock(list->lock);
+#endif
+    count = list->header ? list->header->count : 0;
+    if(count > 0){
+        displacement = list->displacements[hash % count];
+        slot = displacement < 0 ? (apr_uint32_t)(-displacement - 1) : allowlist_slot(hash, (apr_uint32_t)displacement, count);
+        found = list->fingerprints[slot] == hash && list->offsets[slot] < list->values_size
+                && !strcmp(list->values + list->offsets[slot], value);
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(list->lock);
+#endif
+    return found;
+}
 
-        switch (authn_result) {
-          case AUTH_DENIED:
-              ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01807)
-                            "user '%s': authentication failure for \"%s\": "
-                            "password Mismatch",
-                            username, r->uri);
-              return_code = HTTP_UNAUTHORIZED;
-              break;
-          case AUTH_USER_NOT_FOUND:
-              ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01808)
-                            "user '%s' not found: %s", username, r->uri);
-              return_code = HTTP_UNAUTHORIZED;
-              break;
-          case AUTH_GENERAL_ERROR:
-          default:
-              return_code = HTTP_INTERNAL_SERVER_ERROR;
-              break;
-        }
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  CLAIM PATTERNS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
 
-        return return_code;
+static const char *jwt_claim_regex_parse(cmd_parms *cmd, const char *require_line, const void **parsed){
+    regex_matcher *matcher = apr_pcalloc(cmd->pool, sizeof(regex_matcher));
+    const char *line = require_line;
+    PCRE2_SIZE offset;
+    int error;
+
+    matcher->claim = ap_getword_conf(cmd->pool, &line);
+    matcher->pattern = ap_getword_conf(cmd->pool, &line);
+    if(!*matcher->claim || !*matcher->pattern || *line){
+        return "Require jwt-claim-regex takes a claim name and a pattern";
     }
 
-    return OK;
+    matcher->code = pcre2_compile((PCRE2_SPTR)matcher->pattern, PCRE2_ZERO_TERMINATED, 0, &error, &offset, NULL);
+    if(!matcher->code){
+        unsigned char message[256];
+        pcre2_get_error_message(error, message, sizeof(message));
+        return apr_psprintf(cmd->pool, "Invalid pattern %s at offset %d: %s", matcher->pattern, (int)offset, message);
+    }
+    apr_pool_cleanup_register(cmd->pool, matcher->code, regex_code_cleanup, apr_pool_cleanup_null);
+
+    /* the interpreter is used where JIT is not supported */
+    matcher->jit = pcre2_jit_compile(matcher->code, PCRE2_JIT_COMPLETE) == 0;
+    *parsed = matcher;
+    return NULL;
 }
 
+/* Granted if the claim, or one of the elements of an array claim, matches the pattern */
+static authz_status jwt_claim_regex_check(request_rec *r, const char *require_line, const void *parsed){
+    const regex_matcher *matcher = (const regex_matcher *)parsed;
+    const claim_view *view;
+    regex_state *state;
+    int i;
 
-/*
-If we are configured to handle authentication, let's look up headers to find
-whether or not 'Authorization' is set. If so, exepected format is
-Authorization: Bearer json_web_token. Then we check if the token is valid.
-*/
-static int auth_jwt_authn_with_token(request_rec *r){
-    const char *current_auth = NULL;
-    current_auth = ap_auth_type(r);
-    int rv;
+    if(!r->user){
+        return AUTHZ_DENIED_NO_USER;
+    }
 
-    if (!current_auth || strcmp(current_auth, "jwt")) {
-        return DECLINED;
+    if(!request_token(r)){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Require jwt-claim-regex needs AuthType jwt: %s", r->uri);
+        return AUTHZ_DENIED;
     }
 
-    /* We need an authentication realm. */
-    if (!ap_auth_name(r)) {
-       ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                     "need AuthName: %s", r->uri);
-       return HTTP_INTERNAL_SERVER_ERROR;
+    state = regex_state_get();
+    if(!state){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                      "Cannot create match data for %s", matcher->pattern);
+        return AUTHZ_GENERAL_ERROR;
     }
 
-    if (!ap_auth_name(r)) {
-         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                       "need AuthName: %s", r->uri);
-         return HTTP_INTERNAL_SERVER_ERROR;
+    view = request_claim(r, matcher->claim);
+    for(i = 0; view && i < view->count; i++){
+        PCRE2_SPTR value = (PCRE2_SPTR)view->values[i];
+        PCRE2_SIZE len = strlen(view->values[i]);
+        int rv = matcher->jit
+               ? pcre2_jit_match(matcher->code, value, len, 0, 0, state->data, state->context)
+               : pcre2_match(matcher->code, value, len, 0, 0, state->data, state->context);
+        /* 0 is a match with more groups than the match data holds */
+        if(rv >= 0){
+            return AUTHZ_GRANTED;
+        }
+        if(rv != PCRE2_ERROR_NOMATCH){
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
+                          "Cannot match claim %s against %s: error %d", matcher->claim, matcher->pattern, rv);
+            return AUTHZ_GENERAL_ERROR;
+        }
     }
 
-    r->ap_auth_type = (char *) current_auth;
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(01810)
+                  "Claim %s of %s does not match %s: %s", matcher->claim, r->user, matcher->pattern, r->uri);
+    return AUTHZ_DENIED;
+}
 
-    char* authorization_header = (char*)apr_table_get( r->headers_in, "Authorization");
-    char* token_str;
+static apr_status_t regex_code_cleanup(void *data){
+    pcre2_code_free((pcre2_code *)data);
+    return APR_SUCCESS;
+}
 
-    char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
-    if(signature_secret == NULL){
-      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                    "You must specify AuthJWTSignatureSecret directive in configuration");
-      return HTTP_INTERNAL_SERVER_ERROR;
+/* The key is always created: patterns may first appear in .htaccess files */
+static void regex_child_init(apr_pool_t *p, server_rec *s){
+#if APR_HAS_THREADS
+    if(apr_threadkey_private_create(&regex_key, regex_state_free, p) != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01810)
+                     "Cannot create match data key, jwt-claim-regex requirements will fail");
+        regex_key = NULL;
     }
+#endif
+}
 
-    if(!authorization_header){
-        apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool, "Bearer realm=\"", ap_auth_name(r),"\"", NULL));
-        return HTTP_UNAUTHORIZED;
+/* Returns the match data of the calling thread, created on its first call */
+static regex_state *regex_state_get(void){
+    regex_state *state;
+    apr_uint32_t jit = 0;
+
+#if APR_HAS_THREADS
+    void *data = NULL;
+    if(!regex_key){
+        return NULL;
     }
+    if(apr_threadkey_private_get(&data, regex_key) == APR_SUCCESS && data){
+        return (regex_state *)data;
+    }
+#else
+    if(regex_single){
+        return regex_single;
+    }
+#endif
 
-    int header_len = strlen(authorization_header);
-    if(header_len > 7 && !strncmp(authorization_header, "Bearer ", 7)){
-        token_str = authorization_header+7;
-        jwt_t* token;
-        rv = token_check(r, &token, token_str, signature_secret);
-        if(OK == rv){
-            char* maybe_user = (char *)token_get_claim(token, "user");
-            if(maybe_user == NULL){
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                  "Username was not in token");
-                apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool,
-                  "Bearer realm=\"", ap_auth_name(r),"\", error=\"invalid_token\", error_description=\"Username was not in token\"",
-                   NULL));
-                return HTTP_UNAUTHORIZED;
-            }
-            r->user = maybe_user;
-            return OK;
-        }else{
-            return rv;
+    /* thread lifetime: no pool matches it */
+    state = calloc(1, sizeof(regex_state));
+    if(!state){
+        return NULL;
+    }
+    /* only whether there is a match matters, not the groups */
+    state->data = pcre2_match_data_create(1, NULL);
+    state->context = pcre2_match_context_create(NULL);
+    if(!state->data || !state->context){
+        regex_state_free(state);
+        return NULL;
+    }
+    /* without JIT support, no pattern is JIT compiled and no stack can be created */
+    if(pcre2_config(PCRE2_CONFIG_JIT, &jit) >= 0 && jit){
+        state->stack = pcre2_jit_stack_create(REGEX_JIT_STACK_START, REGEX_JIT_STACK_MAX, NULL);
+        if(!state->stack){
+            regex_state_free(state);
+            return NULL;
         }
+        pcre2_jit_stack_assign(state->context, NULL, state->stack);
+    }
 
-        if(token)
-            token_free(token);
-    }else{
-        apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool,
-          "Bearer realm=\"", ap_auth_name(r),"\", error=\"invalid_request\", error_description=\"Authentication type must be Bearer\"",
-           NULL));
-        return HTTP_BAD_REQUEST;
+#if APR_HAS_THREADS
+    if(apr_threadkey_private_set(state, regex_key) != APR_SUCCESS){
+        regex_state_free(state);
+        return NULL;
     }
+#else
+    regex_single = state;
+#endif
+    return state;
 }
 
-static int check_key_length(request_rec *r, const char* key, const char* algorithm){
-    int key_len = (int)strlen(key);
-    if(!strcmp(algorithm, "HS512")){
-        if(key_len!=64){
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                "The secret length must be 64 with HMAC SHA512 algorithm");
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-    }else if(!strcmp(algorithm, "HS384")){
-        if(key_len!=32){
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                "The secret length must be 48 with HMAC SHA384 algorithm (current length is %d)", key_len);
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-    }else if(!strcmp(algorithm, "HS256")){
-        if(key_len!=32){
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-                "The secret length must be 32 with HMAC SHA256 algorithm (current length is %d)", key_len);
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
+static void regex_state_free(void *data){
+    regex_state *state = (regex_state *)data;
+    if(!state){
+        return;
     }
-    else{
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)
-        "The only supported algorithms are HS256 (HMAC SHA256), HS384 (HMAC SHA384), and HS515 (HMAC SHA512)");
-        return 2;
+    if(state->data){
+        pcre2_match_data_free(state->data);
     }
-    return OK;
+    if(state->context){
+        pcre2_match_context_free(state->context);
+    }
+    if(state->stack){
+        pcre2_jit_stack_free(state->stack);
+    }
+    free(state);
 }
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  TOKEN OPERATIONS ~~~~~~~~~~~~~~~~~~~~~~~~~~~~  */
 
-static int token_new(jwt_t **jwt){
-  return jwt_new(jwt);
-}
-
 static int token_check(request_rec *r, jwt_t **jwt, const char *token, const unsigned char *key){
 
     char* signature_secret = (char*)get_config_value(r, dir_signature_secret);
@@ -763,7 +6310,7 @@ static int token_check(request_rec *r, jwt_t **jwt, const char *token, const uns
     const char* iss_config = (char *)get_config_value(r, dir_iss);
     const char* aud_config = (char *)get_config_value(r, dir_aud);
     const char* sub_config = (char *)get_config_value(r, dir_sub);
-    int leeway = *(int*)get_config_value(r, dir_leeway);
+    int leeway = get_leeway(r);
 
     const char* iss_to_check = token_get_claim(*jwt, "iss");
     if(iss_config && iss_to_check && strcmp(iss_config, iss_to_check)!=0){
@@ -814,6 +6361,27 @@ static int token_check(request_rec *r, jwt_t **jwt, const char *token, const uns
         return HTTP_UNAUTHORIZED;
     }
 
+    /* check revocation */
+    const char* jti_str = token_get_claim(*jwt, "jti");
+    if(jti_str && token_revoked(r, claim_hash(jti_str))){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)"Token has been revoked.");
+        apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool,
+          "Bearer realm=\"", ap_auth_name(r),"\", error=\"invalid_token\", error_description=\"Token has been revoked\"",
+           NULL));
+        return HTTP_UNAUTHORIZED;
+    }
+
+    /* check per user invalidation */
+    const char* user_str = token_get_claim(*jwt, "user");
+    const char* iat_str = token_get_claim(*jwt, "iat");
+    if(user_str && user_invalidated(r, user_str, iat_str ? (apr_time_t)atoi(iat_str) : 0)){
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01810)"Token has been invalidated for user %s.", user_str);
+        apr_table_setn(r->err_headers_out, "WWW-Authenticate", apr_pstrcat(r->pool,
+          "Bearer realm=\"", ap_auth_name(r),"\", error=\"invalid_token\", error_description=\"Token has been revoked\"",
+           NULL));
+        return HTTP_UNAUTHORIZED;
+    }
+
     /* check nbf */
     const char* nbf_str = token_get_claim(*jwt, "nbf");
     if(nbf_str){
@@ -831,22 +6399,267 @@ static int token_check(request_rec *r, jwt_t **jwt, const char *token, const uns
     return OK;
 }
 
-static char *token_encode_str(jwt_t *jwt){
-    return jwt_encode_str(jwt);
+static const char* token_get_claim(jwt_t *token, const char* claim){
+    return jwt_get_grant(token, claim);
+}
+
+static void token_free(jwt_t *token){
+    jwt_free(token);
 }
 
-static int token_add_claim(jwt_t *jwt, const char *claim, const char *val){
-    return jwt_add_grant(jwt, claim, val);
+static apr_status_t token_cleanup(void *data){
+    token_free((jwt_t *)data);
+    return APR_SUCCESS;
 }
 
-static const char* token_get_claim(jwt_t *token, const char* claim){
-    return jwt_get_grant(token, claim);
+/*
+Digest identifying a token together with the parameters it was verified
+against, so that a cached result is never reused under another configuration.
+*/
+static void token_digest(request_rec *r, const char *token, unsigned char *digest){
+    const char* params[] = {
+        (char*)get_config_value(r, dir_signature_secret),
+        (char *)get_config_value(r, dir_iss),
+        (char *)get_config_value(r, dir_aud),
+        (char *)get_config_value(r, dir_sub),
+        token
+    };
+    apr_sha1_ctx_t context;
+    int i;
+
+    apr_sha1_init(&context);
+    for(i=0;i<(int)(sizeof(params)/sizeof(params[0]));i++){
+        if(params[i]){
+            apr_sha1_update_binary(&context, (const unsigned char *)params[i], strlen(params[i]) + 1);
+        }else{
+            apr_sha1_update_binary(&context, (const unsigned char *)"", 1);
+        }
+    }
+    apr_sha1_final(digest, &context);
 }
 
-static int token_set_alg(jwt_t *jwt, jwt_alg_t alg, unsigned char *key, int len){
-    return jwt_set_alg(jwt, alg, key, len);
+static apr_uint32_t digest_hash(const unsigned char *digest){
+    return ((apr_uint32_t)digest[0] << 24) | ((apr_uint32_t)digest[1] << 16)
+         | ((apr_uint32_t)digest[2] << 8) | (apr_uint32_t)digest[3];
 }
 
-static void token_free(jwt_t *token){
-    jwt_free(token);
+static apr_uint64_t claim_hash(const char *jti){
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    apr_uint64_t hash = 0;
+    int i;
+
+    apr_sha1_ctx_t context;
+    apr_sha1_init(&context);
+    apr_sha1_update(&context, jti, strlen(jti));
+    apr_sha1_final(digest, &context);
+    for(i=0;i<8;i++){
+        hash = (hash << 8) | digest[i];
+    }
+    /* 0 stands for "no jti" */
+    return hash ? hash : 1;
+}
+
+static const char *generate_jti(apr_pool_t *p){
+    unsigned char bytes[JTI_SIZE];
+    char *jti = apr_palloc(p, 2 * JTI_SIZE + 1);
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    if(random_bytes(bytes, JTI_SIZE) != APR_SUCCESS){
+        return NULL;
+    }
+    for(i=0;i<JTI_SIZE;i++){
+        jti[2*i] = hex[bytes[i] >> 4];
+        jti[2*i+1] = hex[bytes[i] & 0x0f];
+    }
+    jti[2*JTI_SIZE] = 0;
+    return jti;
+}
+
+static void random_child_init(apr_pool_t *p, server_rec *s){
+    apr_status_t rv = apr_generate_random_bytes(random_seed, RANDOM_KEY_SIZE);
+    if(rv != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                     "Cannot seed random generator, the system one will be used");
+        return;
+    }
+#if APR_HAS_THREADS
+    rv = apr_threadkey_private_create(&random_key, random_state_free, p);
+    if(rv != APR_SUCCESS){
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(01810)
+                     "Cannot create random generator key, the system one will be used");
+        random_key = NULL;
+        return;
+    }
+#endif
+    random_seeded = 1;
+}
+
+/* Returns the state of the calling thread, created on its first call */
+static random_state *random_state_get(void){
+    random_state *state;
+    apr_uint32_t id;
+
+#if APR_HAS_THREADS
+    void *data = NULL;
+    if(apr_threadkey_private_get(&data, random_key) == APR_SUCCESS && data){
+        return (random_state *)data;
+    }
+    /* thread lifetime: no pool matches it */
+    state = malloc(sizeof(random_state));
+    if(!state){
+        return NULL;
+    }
+#else
+    state = &random_single;
+    if(random_single_ready){
+        return state;
+    }
+    random_single_ready = 1;
+#endif
+
+    id = apr_atomic_inc32(&random_threads);
+    HMAC(EVP_sha256(), random_seed, RANDOM_KEY_SIZE, (const unsigned char *)&id, sizeof(id), state->key, NULL);
+    random_refill(state);
+
+#if APR_HAS_THREADS
+    if(apr_threadkey_private_set(state, random_key) != APR_SUCCESS){
+        random_state_free(state);
+        return NULL;
+    }
+#endif
+    return state;
+}
+
+static void random_state_free(void *data){
+    if(data){
+        memset(data, 0, sizeof(random_state));
+        free(data);
+    }
+}
+
+static void random_refill(random_state *state){
+    unsigned char block[RANDOM_KEY_SIZE];
+    apr_uint32_t counter;
+
+    for(counter = 0; counter <= RANDOM_BUFFER_SIZE / RANDOM_KEY_SIZE; counter++){
+        HMAC(EVP_sha256(), state->key, RANDOM_KEY_SIZE, (const unsigned char *)&counter, sizeof(counter),
+             counter ? state->buffer + (counter - 1) * RANDOM_KEY_SIZE : block, NULL);
+    }
+    /* the next key is never delivered */
+    memcpy(state->key, block, RANDOM_KEY_SIZE);
+    memset(block, 0, RANDOM_KEY_SIZE);
+    state->pos = 0;
+}
+
+/* Draws len bytes from the generator of the calling thread, without locking */
+static apr_status_t random_bytes(unsigned char *buf, apr_size_t len){
+    random_state *state = random_seeded ? random_state_get() : NULL;
+
+    if(!state){
+        return apr_generate_random_bytes(buf, len);
+    }
+    while(len > 0){
+        apr_size_t n = RANDOM_BUFFER_SIZE - state->pos;
+        if(n == 0){
+            random_refill(state);
+            n = RANDOM_BUFFER_SIZE;
+        }
+        if(n > len){
+            n = len;
+        }
+        memcpy(buf, state->buffer + state->pos, n);
+        /* delivered bytes are wiped from the state */
+        memset(state->buffer + state->pos, 0, n);
+        state->pos += n;
+        buf += n;
+        len -= n;
+    }
+    return APR_SUCCESS;
+}
+
+/* Checks again a cached token: it must neither be expired nor revoked */
+static int verified_token_check(request_rec *r, const verified_token *vt){
+    apr_time_t now = apr_time_sec(r->request_time);
+    if(vt->exp + get_leeway(r) < now){
+        return DECLINED;
+    }
+    if(token_revoked(r, vt->jti)){
+        return DECLINED;
+    }
+    if(user_invalidated(r, vt->user, vt->iat)){
+        return DECLINED;
+    }
+    return OK;
+}
+
+static int verified_token_from_jwt(jwt_t *token, const char *user, verified_token *vt){
+    const char* iat = token_get_claim(token, "iat");
+    const char* auth_time = token_get_claim(token, "auth_time");
+    const char* jti = token_get_claim(token, "jti");
+
+    if(strlen(user) >= CACHED_USER_SIZE){
+        return DECLINED;
+    }
+    vt->exp = (apr_time_t)atoi(token_get_claim(token, "exp"));
+    vt->iat = iat ? (apr_time_t)atoi(iat) : 0;
+    /* tokens delivered before auth_time existed start their session at iat */
+    vt->auth_time = auth_time ? (apr_time_t)atoi(auth_time) : vt->iat;
+    vt->jti = jti ? claim_hash(jti) : 0;
+    apr_cpystrn(vt->user, user, CACHED_USER_SIZE);
+    return OK;
+}
+
+static int get_leeway(request_rec *r){
+    int* leeway_ptr = (int*)get_config_value(r, dir_leeway);
+    return leeway_ptr ? *leeway_ptr : 0;
+}
+
+/*
+Sends a new token along the response when the verified one expires within the
+renewal window. The new token carries the claims create_token delivers at this
+location, for the same user, and the auth_time of the verified one: tokens are
+no longer renewed once the session is older than AuthJWTMaxSessionAge.
+*/
+static void token_renew(request_rec *r, const unsigned char *digest, const verified_token *vt){
+    int* window_ptr = (int*)get_config_value(r, dir_renew_window);
+    int* max_age_ptr = (int*)get_config_value(r, dir_max_session_age);
+    apr_time_t now = apr_time_sec(r->request_time);
+    renew_cache_entry *entry = NULL;
+    char *renewed = NULL;
+
+    if(!window_ptr || *window_ptr <= 0 || r->main || vt->exp - now > *window_ptr){
+        return;
+    }
+    if(max_age_ptr && *max_age_ptr > 0 && now - vt->auth_time >= *max_age_ptr){
+        return;
+    }
+
+    if(renew_cache.entries){
+        entry = &renew_cache.entries[digest_hash(digest) % RENEW_CACHE_SIZE];
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(renew_cache.mutex);
+#endif
+        if(entry->exp >= now && !memcmp(entry->digest, digest, TOKEN_DIGEST_SIZE)){
+            renewed = apr_pstrdup(r->pool, entry->token);
+        }
+    }
+
+    /* signed while holding the lock, so that a token is renewed once in each child */
+    if(!renewed && create_token(r, &renewed, vt->user, vt->auth_time) == OK
+       && entry && strlen(renewed) < RENEWED_TOKEN_SIZE){
+        memcpy(entry->digest, digest, TOKEN_DIGEST_SIZE);
+        entry->exp = vt->exp;
+        apr_cpystrn(entry->token, renewed, RENEWED_TOKEN_SIZE);
+    }
+
+#if APR_HAS_THREADS
+    if(entry){
+        apr_thread_mutex_unlock(renew_cache.mutex);
+    }
+#endif
+
+    if(renewed){
+        apr_table_setn(r->err_headers_out, RENEW_HEADER, renewed);
+    }
 }